@@ -0,0 +1,209 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+#define LISTEN_BACKLOG 16
+#define RELAY_BUF_LEN 4096
+
+static int daemon_fd = -1;
+static char* socket_path = NULL;
+
+
+static bool make_address(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    userlog(LOG_ERR, "socket path too long: %s", path);
+    return false;
+  }
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+
+static int connect_to(struct sockaddr_un* addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*) addr, sizeof(struct sockaddr_un)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+bool init_daemon(const char* path) {
+  struct sockaddr_un addr;
+  if (!make_address(path, &addr)) {
+    return false;
+  }
+
+  // a socket file nobody listens on is a leftover of a crashed daemon
+  int fd = connect_to(&addr);
+  if (fd >= 0) {
+    userlog(LOG_ERR, "another daemon is already listening on %s", path);
+    close(fd);
+    return false;
+  }
+  unlink(path);
+
+  daemon_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (daemon_fd < 0) {
+    userlog(LOG_ERR, "socket: %s", strerror(errno));
+    return false;
+  }
+  if (bind(daemon_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(daemon_fd, LISTEN_BACKLOG) < 0) {
+    userlog(LOG_ERR, "listen(%s): %s", path, strerror(errno));
+    return false;
+  }
+
+  socket_path = strdup(path);
+  signal(SIGPIPE, SIG_IGN);  // a vanished client must not take the daemon down
+  userlog(LOG_INFO, "listening on %s", path);
+  return true;
+}
+
+
+inline int get_daemon_fd() {
+  return daemon_fd;
+}
+
+
+bool accept_client() {
+  int fd = accept(daemon_fd, NULL, NULL);
+  if (fd < 0) {
+    userlog(LOG_WARNING, "accept: %s", strerror(errno));
+    return true;
+  }
+
+  int out_fd = dup(fd);
+  FILE* in = fdopen(fd, "r");
+  FILE* out = (out_fd >= 0 ? fdopen(out_fd, "w") : NULL);
+  if (in == NULL || out == NULL) {
+    userlog(LOG_WARNING, "fdopen: %s", strerror(errno));
+    if (in != NULL)  fclose(in); else close(fd);
+    if (out != NULL)  fclose(out); else if (out_fd >= 0)  close(out_fd);
+    return true;
+  }
+  setvbuf(in, NULL, _IONBF, 0);
+  setvbuf(out, NULL, _IONBF, 0);
+
+  if (session_create(in, out) == NULL) {
+    userlog(LOG_WARNING, "client dropped: %d", fd);  // the streams went with the session
+    return true;
+  }
+  userlog(LOG_INFO, "client connected: %d", fd);
+  return true;
+}
+
+
+void close_daemon() {
+  if (daemon_fd >= 0) {
+    close(daemon_fd);
+    daemon_fd = -1;
+  }
+  if (socket_path != NULL) {
+    unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+  }
+}
+
+
+static bool write_all(int fd, const char* buf, ssize_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno != EINTR) {
+      return false;
+    }
+    else if (n > 0) {
+      buf += n;
+      len -= n;
+    }
+  }
+  return true;
+}
+
+
+// relays stdin/stdout of a regular fsnotifier process to a running daemon
+int run_client(const char* path) {
+  struct sockaddr_un addr;
+  int fd = -1;
+  if (make_address(path, &addr)) {
+    fd = connect_to(&addr);
+  }
+  if (fd < 0) {
+    userlog(LOG_ERR, "cannot connect to %s: %s", path, strerror(errno));
+    printf("GIVEUP\n");
+    return 1;
+  }
+  userlog(LOG_INFO, "connected to %s", path);
+
+  int input_fd = fileno(stdin), output_fd = fileno(stdout);
+  char buf[RELAY_BUF_LEN];
+  bool input_open = true;
+  fd_set rfds;
+
+  while (1) {
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    if (input_open) {
+      FD_SET(input_fd, &rfds);
+    }
+    if (select(MAX(fd, input_fd) + 1, &rfds, NULL, NULL, NULL) < 0) {
+      if (errno == EINTR)  continue;
+      userlog(LOG_ERR, "select: %s", strerror(errno));
+      break;
+    }
+
+    if (input_open && FD_ISSET(input_fd, &rfds)) {
+      ssize_t n = read(input_fd, buf, sizeof(buf));
+      if (n <= 0) {
+        shutdown(fd, SHUT_WR);  // the daemon drops the session and closes its end
+        input_open = false;
+      }
+      else if (!write_all(fd, buf, n)) {
+        break;
+      }
+    }
+    if (FD_ISSET(fd, &rfds)) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0 || !write_all(output_fd, buf, n)) {
+        break;
+      }
+    }
+  }
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+/*
+ * Spurious change suppression: size and mtime of a file are remembered once it is written to, and files up
+ * to hash_limit bytes also get a content hash. Further writes are checked once the file settles (truncate-and-
+ * rewrite comes in several events), and a file that ends up as it was is not reported. Nothing is read while
+ * crawling, so the first write to a file only takes its fingerprint and is always reported.
+ */
+typedef struct {
+  off_t size;
+  struct timespec mtime;
+  uint64_t hash;
+  bool hashed;
+  bool touched;  // written since the last check
+} fingerprint;
+
+// indexed by watch descriptor; descriptors are small, so the array grows with the highest one in use
+static fingerprint** fingerprints = NULL;
+static int slots = 0;
+static size_t hash_limit = 0;
+static char* hash_buf = NULL;
+static unsigned long suppressed = 0;
+static unsigned long passed = 0;
+
+
+// XXH64; the four independent lanes of the main loop are what lets the compiler vectorize it
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+  const unsigned char* p = data;
+  const unsigned char* end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    const unsigned char* limit = end - 32;
+    do {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  }
+  else {
+    h = seed + PRIME64_5;
+  }
+
+  h += (uint64_t) len;
+
+  while (p + 8 <= end) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+
+#define INITIAL_SLOTS 1024
+
+bool init_fingerprints(size_t limit) {
+  fingerprints = calloc(INITIAL_SLOTS, sizeof(fingerprint*));
+  slots = INITIAL_SLOTS;
+  hash_buf = (limit > 0 ? malloc(limit) : NULL);
+  if (fingerprints == NULL || (limit > 0 && hash_buf == NULL)) {
+    userlog(LOG_ERR, "out of memory");
+    close_fingerprints();
+    return false;
+  }
+  hash_limit = limit;
+  return true;
+}
+
+
+inline bool fingerprints_enabled() {
+  return fingerprints != NULL;
+}
+
+
+static inline fingerprint* get_fingerprint(int wd) {
+  return (fingerprints != NULL && wd >= 0 && wd < slots ? fingerprints[wd] : NULL);
+}
+
+
+static bool ensure_slot(int wd) {
+  if (wd < slots) {
+    return true;
+  }
+  int new_slots = slots;
+  while (new_slots <= wd) {
+    new_slots *= 2;
+  }
+  fingerprint** new_fingerprints = realloc(fingerprints, sizeof(fingerprint*) * new_slots);
+  if (new_fingerprints == NULL) {
+    return false;
+  }
+  memset(new_fingerprints + slots, 0, sizeof(fingerprint*) * (new_slots - slots));
+  fingerprints = new_fingerprints;
+  slots = new_slots;
+  return true;
+}
+
+
+static bool hash_file(int fd, off_t size, uint64_t* hash) {
+  if (size < 0 || (size_t) size > hash_limit) {
+    return false;
+  }
+
+  size_t len = 0;
+  while (len < (size_t) size) {
+    ssize_t n = pread(fd, hash_buf + len, size - len, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;  // shrunk or unreadable meanwhile; the next event will tell
+    }
+    len += n;
+  }
+  *hash = xxh64(hash_buf, len, 0);
+  return true;
+}
+
+
+static void take_fingerprint(int fd, struct stat* st, fingerprint* fp) {
+  fp->size = st->st_size;
+  fp->mtime = st->st_mtim;
+  fp->touched = false;
+  fp->hashed = hash_file(fd, st->st_size, &fp->hash);
+}
+
+
+void remember_fingerprint(int wd) {
+  struct stat st;
+  if (fingerprints == NULL || wd < 0 || fstat(wd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+
+  fingerprint* fp = get_fingerprint(wd);
+  if (fp == NULL) {
+    if (!ensure_slot(wd) || (fp = malloc(sizeof(fingerprint))) == NULL) {
+      return;
+    }
+    fingerprints[wd] = fp;
+  }
+  take_fingerprint(wd, &st, fp);
+}
+
+
+void forget_fingerprint(int wd) {
+  fingerprint* fp = get_fingerprint(wd);
+  if (fp != NULL) {
+    free(fp);
+    fingerprints[wd] = NULL;
+  }
+}
+
+
+inline bool fingerprinted(int wd) {
+  return get_fingerprint(wd) != NULL;
+}
+
+
+// marks a file as written; returns false when it is already waiting for a check
+bool touch_fingerprint(int wd) {
+  fingerprint* fp = get_fingerprint(wd);
+  if (fp == NULL || fp->touched) {
+    return false;
+  }
+  fp->touched = true;
+  return true;
+}
+
+
+// tells whether a touched file really differs from what was reported last time; updates the fingerprint
+bool fingerprint_changed(int wd) {
+  struct stat st;
+  fingerprint* fp = get_fingerprint(wd);
+  if (fp == NULL || !fp->touched) {
+    return false;  // gone meanwhile, or reported already
+  }
+  fp->touched = false;
+  if (fstat(wd, &st) != 0) {
+    passed++;
+    return true;
+  }
+
+  bool same;
+  if (st.st_size != fp->size) {
+    same = false;
+    take_fingerprint(wd, &st, fp);
+  }
+  else if (st.st_mtim.tv_sec == fp->mtime.tv_sec && st.st_mtim.tv_nsec == fp->mtime.tv_nsec) {
+    same = true;
+  }
+  else {
+    uint64_t hash;
+    bool hashed = hash_file(wd, st.st_size, &hash);
+    same = (hashed && fp->hashed && hash == fp->hash);
+    fp->mtime = st.st_mtim;
+    fp->hash = hash;
+    fp->hashed = hashed;
+  }
+
+  if (same) {
+    suppressed++;
+  }
+  else {
+    passed++;
+  }
+  return !same;
+}
+
+
+void get_fingerprint_counters(unsigned long* suppressed_count, unsigned long* passed_count) {
+  *suppressed_count = suppressed;
+  *passed_count = passed;
+}
+
+
+void close_fingerprints() {
+  if (fingerprints != NULL) {
+    for (int i=0; i<slots; i++) {
+      free(fingerprints[i]);
+    }
+    free(fingerprints);
+    fingerprints = NULL;
+    slots = 0;
+  }
+  free(hash_buf);
+  hash_buf = NULL;
+}
@@ -17,23 +17,114 @@
 #ifndef __FSNOTIFIER_H
 #define __FSNOTIFIER_H
 
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 
 // variable-length array
 typedef struct __array array;
 
-typedef struct __watch_node {
-  char* name;
-  int wd;
-  int isdir;
-  struct __watch_node* parent;
-  array* kids;
-} watch_node;
+/*
+ * Watch tree. Nodes live in a struct-of-arrays store and are referred to by 32-bit ids; NO_NODE is none.
+ * Kid lists of up to INLINE_KIDS entries are kept in the store, longer ones spill to the heap.
+ */
+typedef uint32_t node_id;
+#define NO_NODE 0
+
+#define INLINE_KIDS 2
+
+typedef struct {
+  uint32_t size;
+  uint32_t capacity;  // 0 while the kids are inline
+  union {
+    node_id inline_ids[INLINE_KIDS];
+    node_id* ids;
+  } u;
+} kid_list;
+
+typedef struct {
+  char** name;
+  int* wd;
+  node_id* parent;      // the next free id for freed nodes
+  node_id* alias;       // the next node sharing the descriptor: another path to the same file
+  uint16_t* flags;
+  node_id* older;       // neighbours on the activity list of directories with files, see enforce_memory_limit()
+  node_id* newer;
+  unsigned int* churn;  // events in and below the directory in the current window, see NODE_COARSE
+  kid_list* kids;
+  uint32_t capacity;
+  uint32_t used;
+  node_id free_list;
+} node_store;
+
+extern node_store nodes;
+
+// node flags
+#define NODE_RESCAN 0x01   // a re-scan of the directory is queued
+#define NODE_DIRONLY 0x02  // files in the directory are not watched, see set_memory_limit()
+#define NODE_LISTED 0x04   // on the activity list
+#define NODE_SKIPPED 0x08  // ignored or not readable: kept without a descriptor, as a name in its directory only
+#define NODE_SEEN 0x10     // a name without a descriptor was listed again by a re-scan of its directory
+#define NODE_COARSE 0x20   // high churn: files below are not watched, changes are reported as RECDIRTY
+#define NODE_DIRTY 0x40    // a coarse directory has changes to report
+#define NODE_DIR 0x80
+#define NODE_NOCHANGE 0x100  // the root wants no CHANGE events, see parse_root()
+#define NODE_NOSTATS 0x200   // the root wants no STATS events; with neither, files are kept without a descriptor
+#define NODE_LAZY 0x400      // not expanded by the client: files are not watched, see set_lazy_depth()
+
+// node ids kept in arrays
+#define NODE_PTR(n) ((void*) (uintptr_t) (n))
+#define PTR_NODE(p) ((node_id) (uintptr_t) (p))
+
+node_id node_create(const char* name, int wd, bool isdir, node_id parent);
+void node_delete(node_id n);
+bool node_add_kid(node_id n, node_id kid);
+void node_compact_kids(node_id n);
+size_t node_kids_memory(node_id n);
+size_t node_memory(node_id n);
+size_t node_estimate(size_t name_length, uint32_t kid_count);
+void close_nodes();
+
+static inline const char* node_name(node_id n) {
+  return nodes.name[n];
+}
+
+static inline int node_wd(node_id n) {
+  return nodes.wd[n];
+}
+
+static inline node_id node_parent(node_id n) {
+  return nodes.parent[n];
+}
+
+static inline bool node_isdir(node_id n) {
+  return (nodes.flags[n] & NODE_DIR) != 0;
+}
+
+static inline int node_kid_count(node_id n) {
+  return nodes.kids[n].size;
+}
+
+// valid until the next node_create() or node_add_kid()
+static inline node_id* node_kids(node_id n) {
+  return (nodes.kids[n].capacity == 0 ? nodes.kids[n].u.inline_ids : nodes.kids[n].u.ids);
+}
+
+static inline node_id node_kid(node_id n, int i) {
+  return node_kids(n)[i];
+}
+
 // logging
 void userlog(int priority, const char* format, ...);
 
+// asynchronous logging; log_ring_put() returns false when the ring is not running
+bool start_log_ring();
+bool log_ring_put(int priority, const char* format, va_list ap);
+void stop_log_ring();
+unsigned long get_log_drops();
+
 
 
 array* array_create(int initial_capacity);
@@ -44,6 +135,10 @@ void array_put(array* a, int index, void* element);
 void* array_get(array* a, int index);
 void array_delete(array* a);
 void array_delete_vs_data(array* a);
+void* array_remove(array* a, int index);
+void* array_remove_ordered(array* a, int index);
+void array_compact(array* a);
+void array_sort(array* a, int (* compare)(const void*, const void*));
 
 
 // key/value pairs table
@@ -56,6 +151,9 @@ void table_delete(table* t);
 
 
 // inotify subsystem
+struct kevent;
+struct stat;
+
 enum {
   ERR_IGNORE = -1,
   ERR_CONTINUE = -2,
@@ -66,20 +164,170 @@ bool init_inotify();
 void set_inotify_callback(void (* callback)(char*, int));
 int get_inotify_fd();
 int get_watch_count();
+int get_node_count();
+int get_alias_count();
+void set_memory_limit(size_t bytes);
+size_t get_memory_limit();
+size_t get_memory_used();
+size_t get_table_memory();
+size_t get_root_memory(node_id root);
+void set_lazy_depth(int depth);
+void expand(node_id node);
+void collapse(node_id node);
 bool watch_limit_reached();
-int watch(const char* root, watch_node* parent, array* ignores);
-void unwatch(int id);
-bool process_inotify_input();
+typedef void (* crawl_callback)(void* data, int result);
+
+int watch(const char* root, node_id parent, array* ignores, crawl_callback callback, void* data);
+void cancel_watch(void* data);
+bool finish_crawls();
+bool finish_rescans();
+void flush_delayed_events();
+void unwatch(node_id node);
+node_id find_node(node_id parent, const char* path);
+bool event_stat(const char* path, struct stat* st);
+
+// what watching a tree would take, see estimate_tree()
+typedef struct {
+  unsigned long dirs, files;
+  unsigned long fds;
+  size_t memory;
+  unsigned long crawl_ms;
+  bool sampled;   // some directories stand for their skipped siblings
+  bool complete;  // false when the walk ran out of time; the figures cover the part walked
+} tree_estimate;
+
+typedef void (* estimate_callback)(void* data, const char* root, const tree_estimate* estimate);
+
+bool estimate_tree(const char* root, bool file_fds, array* ignores, estimate_callback callback, void* data);
+void cancel_estimates(void* data);
+bool process_inotify_events(struct kevent* events, int count);
 void close_inotify();
 
 
+// spurious change suppression; files up to hash_limit bytes are compared by content, the rest by size and mtime
+bool init_fingerprints(size_t hash_limit);
+bool fingerprints_enabled();
+void remember_fingerprint(int wd);
+void forget_fingerprint(int wd);
+bool fingerprinted(int wd);
+bool touch_fingerprint(int wd);
+bool fingerprint_changed(int wd);
+void get_fingerprint_counters(unsigned long* suppressed, unsigned long* passed);
+void close_fingerprints();
+
+
+// recording of kernel events and of what the crawler saw, and its replay against a scratch directory
+bool init_recording(const char* path);
+void record_roots(array* roots);
+void record_watch(int wd, const char* path, bool isdir);
+void record_unwatch(int wd);
+void record_entry(int wd, const char* name, bool isdir);
+void record_listed(int wd);
+void record_events(struct kevent* events, int count);
+void close_recording();
+bool start_replay(const char* file, const char* dir);
+bool replaying();
+void close_replay();
+
+
+// event loop; input sources and timers share the inotify kqueue
+typedef bool (* source_callback)(void* data);
+typedef void (* timer_callback)(void* data);
+typedef struct __timer timer;
+
+bool loop_add_source(int fd, source_callback callback, void* data);
+void loop_remove_source(int fd);
+bool loop_add_writer(int fd, source_callback callback, void* data);
+void loop_remove_writer(int fd);
+timer* loop_add_timer(int delay_ms, timer_callback callback, void* data);
+void loop_cancel_timer(timer* t);
+void loop_run();
+bool loop_drain_events();
+void loop_stop();
+void close_loop();
+
+
 // reads one line from stream, trims trailing carriage return if any
 // returns pointer to the internal buffer (will be overwriten on next call)
 char* read_line(FILE* stream);
 
+// commands are framed the same by sessions and the shard front; a longer one ends the input
+size_t command_length(const char* input, size_t input_len);
+#define INPUT_LIMIT (16 * 1024 * 1024)
+
+// events a root is subscribed to besides creation and deletion
+#define ROOT_CHANGES 0x01
+#define ROOT_STATS 0x02
+#define ROOT_ALL (ROOT_CHANGES | ROOT_STATS)
+
+// splits a ROOTS line into the path (returned) and the event mask
+const char* parse_root(const char* line, int* mask);
+
 extern int level;
 extern array* UNWATCHABLE;
 extern array* ROOTS;
 void output(const char* format, ...);
+void output_event(const char* type, const char* path);
+bool has_hot_paths();
+bool is_hot_path(const char* path);
+bool is_expanded(const char* path);
+
+
+// batching of events during VCS operations; vcs_hold() takes an event while the repository of its path is updated
+bool init_vcs(bool bulk_markers);
+void vcs_watch(const char* work_tree, node_id root);
+void vcs_unwatch(node_id root);
+bool vcs_hold(const char* type, const char* path);
+size_t get_vcs_held();
+void close_vcs();
+
+
+// non-blocking output queues; the drain callback is called once a congested queue is written out far enough
+typedef struct __out_queue out_queue;
+typedef void (* drain_callback)(void* data);
+
+out_queue* queue_create(int fd, drain_callback drained, void* data);
+void queue_vprintf(out_queue* q, const char* format, va_list ap);
+void queue_printf(out_queue* q, const char* format, ...);
+bool queue_congested(out_queue* q);
+size_t queue_length(out_queue* q);
+void queue_delete(out_queue* q, bool finish);
+
+
+// shared-memory event rings, an alternative to sending events through the output queue
+typedef struct __event_ring event_ring;
+
+event_ring* ring_create(const char* path);
+bool ring_accepts(const char* type);
+bool ring_put(event_ring* r, const char* type, const char* path, uint64_t seq, const struct stat* st);
+bool ring_take_waiter(event_ring* r);
+size_t ring_used(event_ring* r);
+size_t ring_capacity(event_ring* r);
+void ring_delete(event_ring* r);
+
+
+// client sessions; each one owns a set of roots and gets events under them only
+typedef struct __session session;
+
+session* session_create(FILE* in, FILE* out);
+void session_delete(session* s);
+
+
+// daemon mode
+bool init_daemon(const char* path);
+int get_daemon_fd();
+bool accept_client();
+void close_daemon();
+int run_client(const char* path);
+
+
+// shards: worker processes with a part of the roots each, behind a front process talking to the client
+#define SHARD_NONE -1
+#define SHARD_FRONT -2
+#define SHARD_ROOTS_REPLY "UNWATCHEABLE ROOTS"  // a shard's answer to ROOTS, unlike the notice of a failed crawl
+
+int start_shards(int count);
+int run_front();
+void close_shards();
 
 #endif
@@ -28,6 +28,8 @@
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <time.h>
 #include <sysexits.h>
 #include <fcntl.h>
 #include <err.h>
@@ -43,12 +45,158 @@
 
 static int inotify_fd = -1;
 static int watch_count = 1000000;
-static table* watches;
+static node_id* watches;  // by descriptor
 static bool limit_reached = false;
 static void (* callback)(char*, int) = NULL;
-#define EVENT_SIZE (sizeof(struct kevent))
-#define EVENT_BUF_LEN (2048 * (EVENT_SIZE + 16))
-static struct kevent event_buf[2048];
+
+/*
+ * Crawling is resumable: a job keeps an explicit stack of directories being read, and the loop runs
+ * jobs in slices of CRAWL_SLICE_MS between event processing. Re-scans triggered by events share one job
+ * and go before root crawls; a hot directory is re-scanned on the spot, and while there are hot paths each
+ * slice first handles the kernel events queued meanwhile.
+ */
+#define CRAWL_SLICE_MS 20
+#define CRAWL_CLOCK_EVERY 64
+
+typedef struct {
+	char* path;
+	int wd;
+	node_id node;      // frames outlive nodes removed meanwhile; see frame_node()
+	DIR* dir;          // opened when the frame is first read
+} crawl_frame;
+
+typedef struct {
+	array* frames;     // a stack; the top frame is read first
+	array* ignores;
+	int isevent;
+	int root;
+	node_id root_node;
+	crawl_callback callback;
+	void* data;
+} crawl_job;
+
+static crawl_job* rescan_job = NULL;
+static array* root_jobs = NULL;  // in ROOTS order, which READY follows
+static struct __estimate_job* estimates = NULL;  // a queue, see estimate_tree()
+static struct __estimate_job* last_estimate = NULL;
+static timer* crawl_timer = NULL;
+
+/*
+ * Memory accounting: nodes, their names and kid arrays are counted globally and per root holder.
+ * Beyond the limit, the least recently active directories lose their file watches (NODE_DIRONLY); they are
+ * kept on an activity list as they get files and events, so none has to be searched for. Once memory use
+ * falls below RESTORE_PERCENT of the limit, degraded directories get their files back one by one, the last
+ * degraded first.
+ */
+#define RESTORE_PERCENT 75
+
+typedef struct {
+	node_id node;
+	int wd;
+} degraded_dir;
+
+typedef struct {
+	node_id holder;
+	size_t bytes;
+} root_usage;
+
+static array* usages = NULL;
+static size_t memory_used = 0;
+static size_t memory_limit = 0;
+static size_t degrade_watermark = 0;
+static node_id oldest_dir = NO_NODE;  // the activity list
+static node_id newest_dir = NO_NODE;
+static array* degraded_dirs = NULL;
+static int node_count = 0;
+
+static void list_dir(node_id node);
+static void unlist_dir(node_id node);
+static void enforce_memory_limit();
+static void restore_degraded();
+
+// files written with change suppression on wait SETTLE_MS for the writer to finish before being compared
+#define SETTLE_MS 50
+
+static array* settling = NULL;
+static timer* settle_timer = NULL;
+
+/*
+ * Churn: events are counted per directory and its ancestors over CHURN_WINDOW_MS windows. The innermost
+ * directory getting CHURN_LIMIT events in a window (build output, node_modules) turns coarse: files below it
+ * are unwatched and changes there are summed up into a debounced RECDIRTY. After CHURN_QUIET_WINDOWS windows
+ * with less than CHURN_QUIET events its files are watched again. Only the directories counted in a window are
+ * looked at when it ends, so a quiet tree costs nothing however large it is.
+ */
+#define CHURN_WINDOW_MS 1000
+#define CHURN_LIMIT 1000
+#define CHURN_QUIET 10
+#define CHURN_QUIET_WINDOWS 10
+#define DIRTY_DELAY_MS 200
+
+typedef struct {
+	node_id node;
+	int wd;
+	int quiet;  // windows in a row below CHURN_QUIET
+} coarse_dir;
+
+static array* coarse_dirs = NULL;
+static crawl_job* restore_job = NULL;  // silently re-adds files of directories that calmed down or were degraded
+static array* restored = NULL;         // their paths, reported once the job is done; also used by expand()
+static array* churned = NULL;          // directories with events in the current window
+static timer* churn_timer = NULL;
+static timer* dirty_timer = NULL;
+static int lazy_depth = -1;  // off; see set_lazy_depth()
+
+/*
+ * Attributes of reported paths (see event_stat()) are taken with fstat() on the descriptor held for the
+ * path, at most once per descriptor and kevent drain; a drain, crawl slice or settle check starts a generation.
+ */
+#define STAT_SLOTS 1024
+
+typedef struct {
+	int wd;
+	unsigned long generation;
+	bool ok;
+	struct stat st;
+} stat_slot;
+
+static stat_slot stat_cache[STAT_SLOTS];
+static unsigned long stat_generation = 1;
+static node_id event_node = NO_NODE;  // the node an event is being reported for
+
+static void mark_dirty(node_id node);
+static void count_churn(node_id node);
+
+/*
+ * Inodes: each file is opened and registered with the kernel once. Further paths reaching it (nested or
+ * overlapping roots, hard links, symlinks) become aliases: nodes of their own chained to the one owning the
+ * descriptor, and events on the descriptor go to all of them.
+ */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	int wd;  // -1 for a free slot
+} inode_slot;
+
+static inode_slot* inodes = NULL;  // open addressing; the capacity is a power of two
+static uint32_t inode_capacity = 0;
+static uint32_t inode_count = 0;
+static int alias_count = 0;
+
+typedef struct {
+	node_id node;
+	int twin;      // the first alias with the same path; it keeps the events reported for the path
+	int reported;
+} alias_ref;
+
+static alias_ref* alias_buf = NULL;
+static int alias_buf_len = 0;
+
+static crawl_job* create_job(array* ignores, int isevent);
+static void delete_job(crawl_job* job);
+static bool push_frame(crawl_job* job, node_id node, DIR* dir);
+static void schedule_crawl();
+static bool run_estimates(uint64_t deadline);
 
 
 bool init_inotify() {
@@ -60,8 +208,17 @@ bool init_inotify() {
 	userlog(LOG_DEBUG, "inotify fd: %d", get_inotify_fd());
 	userlog(LOG_INFO, "inotify watch descriptors: %d", watch_count);
 
-	watches = table_create(watch_count);
-	if (watches == NULL) {
+	watches = calloc(watch_count, sizeof(node_id));
+	root_jobs = array_create(DEFAULT_SUBDIR_COUNT);
+	rescan_job = create_job(NULL, 1);
+	restore_job = create_job(NULL, 0);
+	usages = array_create(DEFAULT_SUBDIR_COUNT);
+	coarse_dirs = array_create(DEFAULT_SUBDIR_COUNT);
+	churned = array_create(DEFAULT_SUBDIR_COUNT);
+	restored = array_create(DEFAULT_SUBDIR_COUNT);
+	degraded_dirs = array_create(DEFAULT_SUBDIR_COUNT);
+	if (watches == NULL || root_jobs == NULL || rescan_job == NULL || restore_job == NULL || usages == NULL ||
+			coarse_dirs == NULL || churned == NULL || restored == NULL || degraded_dirs == NULL) {
 		userlog(LOG_ERR, "out of memory");
 		close(inotify_fd);
 		inotify_fd = -1;
@@ -92,289 +249,1653 @@ inline bool watch_limit_reached() {
 }
 
 
-static int add_watch(const char* path, watch_node* parent,int isdir, int isevent) {
-	userlog(LOG_DEBUG,"add_watch: Trying to add path:%s for parent:%s",path,parent?parent->name:"(null)");	
+inline int get_alias_count() {
+	return alias_count;
+}
+
+
+inline int get_node_count() {
+	return node_count;
+}
+
+
+void set_memory_limit(size_t bytes) {
+	memory_limit = degrade_watermark = bytes;
+}
+
+
+inline size_t get_memory_limit() {
+	return memory_limit;
+}
+
+
+inline size_t get_memory_used() {
+	return memory_used;
+}
+
+
+inline size_t get_table_memory() {
+	return sizeof(node_id) * watch_count + sizeof(inode_slot) * inode_capacity;
+}
+
+
+// the node owning a descriptor; its aliases follow in nodes.alias
+static inline node_id node_at(int wd) {
+	return (wd >= 0 && wd < watch_count ? watches[wd] : NO_NODE);
+}
+
+// whether a node id kept across loop iterations still refers to the same watch
+static inline bool node_alive(node_id node, int wd) {
+	return node != NO_NODE && node_name(node) != NULL && node_wd(node) == wd;
+}
+
+
+static inline uint32_t inode_hash(dev_t dev, ino_t ino) {
+	uint64_t h = (uint64_t) ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t) dev;
+	return (uint32_t) (h ^ (h >> 29));
+}
+
+static int find_inode(dev_t dev, ino_t ino) {
+	uint32_t mask = inode_capacity - 1;
+	for (uint32_t i = (inode_count > 0 ? inode_hash(dev, ino) & mask : 0); inode_count > 0 && inodes[i].wd >= 0;
+			i = (i + 1) & mask) {
+		if (inodes[i].dev == dev && inodes[i].ino == ino) {
+			return inodes[i].wd;
+		}
+	}
+	return -1;
+}
+
+static void insert_inode(inode_slot* slots, uint32_t capacity, dev_t dev, ino_t ino, int wd) {
+	uint32_t i = inode_hash(dev, ino) & (capacity - 1);
+	while (slots[i].wd >= 0) {
+		i = (i + 1) & (capacity - 1);
+	}
+	slots[i].dev = dev;
+	slots[i].ino = ino;
+	slots[i].wd = wd;
+}
+
+static bool put_inode(dev_t dev, ino_t ino, int wd) {
+	if ((inode_count + 1) * 2 > inode_capacity) {
+		uint32_t capacity = (inode_capacity > 0 ? inode_capacity * 2 : 1024);
+		inode_slot* slots = malloc(sizeof(inode_slot) * capacity);
+		if (slots == NULL) {
+			return false;
+		}
+		for (uint32_t i = 0; i < capacity; i++) {
+			slots[i].wd = -1;
+		}
+		for (uint32_t i = 0; i < inode_capacity; i++) {
+			if (inodes[i].wd >= 0) {
+				insert_inode(slots, capacity, inodes[i].dev, inodes[i].ino, inodes[i].wd);
+			}
+		}
+		free(inodes);
+		inodes = slots;
+		inode_capacity = capacity;
+	}
+	insert_inode(inodes, inode_capacity, dev, ino, wd);
+	inode_count++;
+	return true;
+}
+
+// backward-shift deletion: later entries of the probe run move up, so lookups need no tombstones
+static void drop_inode(int wd) {
+	struct stat st;
+	if (inode_count == 0 || fstat(wd, &st) != 0) {
+		return;
+	}
+	uint32_t mask = inode_capacity - 1, i = inode_hash(st.st_dev, st.st_ino) & mask;
+	while (inodes[i].wd >= 0 && inodes[i].wd != wd) {
+		i = (i + 1) & mask;
+	}
+	if (inodes[i].wd < 0) {
+		return;
+	}
+	inodes[i].wd = -1;
+	inode_count--;
+
+	for (uint32_t j = (i + 1) & mask; inodes[j].wd >= 0; j = (j + 1) & mask) {
+		uint32_t home = inode_hash(inodes[j].dev, inodes[j].ino) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			inodes[i] = inodes[j];
+			inodes[j].wd = -1;
+			i = j;
+		}
+	}
+}
+
+// whether another node of the descriptor (only those before it in the chain if asked) has the same path;
+// overlapping roots hold such twins, and only one of them reports. Twins with any of the flags do not count.
+static bool has_twin(node_id node, bool before, uint16_t without) {
+	for (node_id n = watches[node_wd(node)]; n != NO_NODE; n = nodes.alias[n]) {
+		if (n == node) {
+			if (before) {
+				return false;
+			}
+		} else if (!(nodes.flags[n] & without) && strcmp(node_name(n), node_name(node)) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// kernel events needed for a node with the given mask flags; directories need writes to see new entries
+static u_int vnode_fflags(uint16_t flags, bool isdir) {
+	u_int fflags = NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE;
+	if (isdir || !(flags & NODE_NOCHANGE)) {
+		fflags |= NOTE_WRITE | NOTE_EXTEND;
+	}
+	if (!(flags & NODE_NOSTATS)) {
+		fflags |= NOTE_ATTRIB;
+	}
+	return fflags;
+}
+
+// what all paths of a descriptor need together
+static u_int chain_fflags(int wd) {
+	u_int fflags = 0;
+	for (node_id n = watches[wd]; n != NO_NODE; n = nodes.alias[n]) {
+		fflags |= vnode_fflags(nodes.flags[n], node_isdir(n));
+	}
+	return fflags;
+}
 
-	if(parent == NULL ) {
+// adds the descriptor to the kqueue, or changes the events of one added before
+static void register_vnode(int wd, u_int fflags, const char* path) {
+	struct kevent change;
+	EV_SET(&change, wd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR, fflags, 0, NULL);
+
+	// a replay takes its events from the recording
+	if(!replaying() && kevent(inotify_fd, &change, 1, NULL, 0, NULL) < 0) {
+		userlog(LOG_ERR, "kevent add event failed for: %s, %s", path, strerror(errno));
+		err(EX_IOERR, "kevent add event failed for: %s",path);
+	} else {
+		userlog(LOG_DEBUG, "watching %s: %d", path, wd);
+	}
+}
+
+// takes a node out of the chain of its descriptor; the next alias owns the descriptor if it was the owner
+static void unlink_alias(node_id node) {
+	int wd = node_wd(node);
+	node_id owner = watches[wd];
+	if (owner == node) {
+		watches[wd] = nodes.alias[node];
+		record_watch(wd, node_name(watches[wd]), node_isdir(watches[wd]));
+	} else {
+		node_id prev = owner;
+		while (nodes.alias[prev] != node) {
+			prev = nodes.alias[prev];
+		}
+		nodes.alias[prev] = nodes.alias[node];
+	}
+	nodes.alias[node] = NO_NODE;
+	alias_count--;
+}
+
+
+static root_usage* usage_of(node_id node) {
+	while (node_parent(node) != NO_NODE) {
+		node = node_parent(node);
+	}
+	for (int i = 0; i < array_size(usages); i++) {
+		root_usage* usage = array_get(usages, i);
+		if (usage->holder == node) {
+			return usage;
+		}
+	}
+
+	root_usage* usage = calloc(1, sizeof(root_usage));
+	if (usage == NULL || array_push(usages, usage) == NULL) {
+		free(usage);
+		return NULL;
+	}
+	usage->holder = node;
+	return usage;
+}
+
+
+static void account(root_usage* usage, size_t added, size_t removed) {
+	memory_used += added - removed;
+	if (usage != NULL) {
+		usage->bytes += added - removed;
+		if (usage->bytes == 0) {
+			for (int i = 0; i < array_size(usages); i++) {
+				if (array_get(usages, i) == usage) {
+					array_remove(usages, i);
+					free(usage);
+					break;
+				}
+			}
+		}
+	}
+}
+
+
+size_t get_root_memory(node_id root) {
+	for (int i = 0; i < array_size(usages); i++) {
+		root_usage* usage = array_get(usages, i);
+		if (usage->holder == root) {
+			return usage->bytes;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Returns the descriptor of the watch, ERR_IGNORE for a file kept without one; *added is the node
+ * if one was created for path. A skipped path is only kept as a name, see NODE_SKIPPED.
+ */
+static int add_watch(const char* path, node_id parent,int isdir, int isevent, bool skipped, node_id* added) {
+	*added = NO_NODE;
+	userlog(LOG_DEBUG,"add_watch: Trying to add path:%s for parent:%s",path,parent!=NO_NODE?node_name(parent):"(null)");	
+
+	if(parent == NO_NODE ) {
 		for(int i = 0; i < array_size(ROOTS); i++) {
-			watch_node* node = array_get(ROOTS, i);
-			if(node!=NULL && node->name!=NULL && strcmp(node->name,path) == 0) {
+			node_id node = PTR_NODE(array_get(ROOTS, i));
+			if(node!=NO_NODE && node_name(node)!=NULL && strcmp(node_name(node),path) == 0) {
 				userlog(LOG_DEBUG,"add_watch: node is already under ROOTS");
-				return node->wd;
+				return node_wd(node);
 			}
 		}
 	} else {
-		if (parent->name!=NULL && strcmp(parent->name,path)==0) {
+		if (node_name(parent)!=NULL && strcmp(node_name(parent),path)==0) {
 			userlog(LOG_DEBUG,"add_watch: node is the same as parent");
-			return parent->wd;
-		}
-		if(parent->kids != NULL) {
-			for(int i = 0; i< array_size(parent->kids); i++) {
-				watch_node* kid = array_get(parent->kids, i);
-				if(kid!=NULL && strcmp(kid->name, path)==0) {
-					userlog(LOG_DEBUG,"add_watch: node is already under parent");
-					return kid->wd;
+			return node_wd(parent);
+		}
+		for(int i = 0; i< node_kid_count(parent); i++) {
+			node_id kid = node_kid(parent, i);
+			if(kid != NO_NODE && strcmp(node_name(kid), path)==0) {
+				userlog(LOG_DEBUG,"add_watch: node is already under parent");
+				if (node_wd(kid) < 0) {
+					nodes.flags[kid] |= NODE_SEEN;
 				}
+				return node_wd(kid);
 			}
 		}
 	}
 
 
-	struct kevent eventlist[2];
-	int nevents = 0;
-	int wd = open(path, O_RDONLY);
+	// the event mask of the root; files of roots wanting neither changes nor stats are not opened
+	uint16_t mask = (parent != NO_NODE ? nodes.flags[parent] & (NODE_NOCHANGE | NODE_NOSTATS) : 0);
+	node_id owner = NO_NODE;
+	struct stat st;
+	int wd = -1;
+	if (skipped || (!isdir && mask == (NODE_NOCHANGE | NODE_NOSTATS) && node_name(parent) != NULL)) {
+		goto add_node;
+	}
+
+	wd = (stat(path, &st) == 0 ? find_inode(st.st_dev, st.st_ino) : -1);
+	owner = node_at(wd);
+	if (owner != NO_NODE) {
+		userlog(LOG_DEBUG, "watching %s: %d (alias of %s)", path, wd, node_name(owner));
+		goto add_node;
+	}
+
+	wd = open(path, O_RDONLY);
 	if(wd < 0 ) {
 		userlog(LOG_ERR, "add_watch, cannot open: %s, err:%s", path, strerror(errno));
 		return ERR_CONTINUE;
 	}
-	EV_SET(&eventlist[0], wd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR,
+	if (wd >= watch_count) {
+		userlog(LOG_ERR, "table error: unable to put (%d:%s)", wd, path);
+		close(wd);
+		return ERR_ABORT;
+	}
+	if (fstat(wd, &st) == 0 && (owner = node_at(find_inode(st.st_dev, st.st_ino))) != NO_NODE) {
+		close(wd);  // replaced by a known file since the stat() above
+		wd = node_wd(owner);
+		goto add_node;
+	}
+	register_vnode(wd, vnode_fflags(mask, isdir), path);
+
+	node_id node = watches[wd];
+	if (node != NO_NODE) {
+		if (node_wd(node) != wd || strcmp(node_name(node), path) != 0) {
+			userlog(LOG_ERR, "table error: collision (new %d:%s, existing %d:%s)", wd, path, node_wd(node), node_name(node));
+			return ERR_ABORT;
+		}
+
+		return wd;
+	}
+	if (!put_inode(st.st_dev, st.st_ino, wd)) {
+		userlog(LOG_ERR, "out of memory");
+		close(wd);
+		return ERR_ABORT;
+	}
+
+add_node:
+	node = node_create(path, wd, isdir, parent);
+	if (node == NO_NODE) {
+		userlog(LOG_ERR, "out of memory");
+		return ERR_ABORT;
+	}
+	nodes.flags[node] |= mask | (wd < 0 ? NODE_SEEN : 0) | (skipped ? NODE_SKIPPED : 0);
+	if (isdir && parent != NO_NODE && (nodes.flags[parent] & NODE_COARSE)) {
+		nodes.flags[node] |= NODE_COARSE;
+	}
+	if (isdir && parent != NO_NODE && (node_name(parent) == NULL ? lazy_depth >= 0 : (nodes.flags[parent] & NODE_LAZY))) {
+		nodes.flags[node] |= NODE_LAZY;
+	}
+
+
+	size_t kids_memory = 0;
+	if(parent!=NO_NODE) {
+		kids_memory = node_kids_memory(parent);
+		if (!node_add_kid(parent, node)) {
+			userlog(LOG_ERR, "out of memory");
+			node_delete(node);
+			return ERR_ABORT;
+		}
+		kids_memory = node_kids_memory(parent) - kids_memory;
+	}
+	account(usage_of(node), node_memory(node) + kids_memory, 0);
+	node_count++;
+	if (!isdir && parent != NO_NODE && node_name(parent) != NULL && !(nodes.flags[parent] & NODE_LISTED)) {
+		list_dir(parent);
+	}
+	if (owner != NO_NODE) {
+		u_int fflags = chain_fflags(wd);
+		nodes.alias[node] = nodes.alias[owner];
+		nodes.alias[owner] = node;
+		alias_count++;
+		if ((fflags | vnode_fflags(mask, isdir)) != fflags) {
+			register_vnode(wd, fflags | vnode_fflags(mask, isdir), path);
+		}
+	} else if (wd >= 0) {
+		watches[wd] = node;
+		record_watch(wd, path, isdir);
+	}
+
+	if (isevent && parent != NO_NODE) {
+		count_churn(parent);
+	}
+	if (isevent && parent != NO_NODE && (nodes.flags[parent] & NODE_COARSE)) {
+		mark_dirty(parent);
+	} else if(isevent && (owner == NO_NODE || !has_twin(node, false, 0))) {
+		event_node = node;
+		output_event("CREATE", path);
+		event_node = NO_NODE;
+	}
+	*added = node;
+
+	if (memory_limit > 0 && memory_used > degrade_watermark) {
+		enforce_memory_limit();
+	}
+	return wd;
+}
+
+
+static void rm_node(node_id node, bool update_parent, root_usage* usage) {
+	int wd = node_wd(node);
+	userlog(LOG_DEBUG, "unwatching %s: %d (%u)", node_name(node), wd, node);
+	struct kevent eventlist[2];
+	int nevents=0;
+	EV_SET(&eventlist[0], wd, EVFILT_VNODE, EV_DELETE, 
 			NOTE_DELETE | NOTE_WRITE | NOTE_RENAME
 			| NOTE_EXTEND | NOTE_ATTRIB | NOTE_REVOKE,
 			0, NULL);
 	nevents++;
 
-	if(kevent(inotify_fd, eventlist, 
+	// other paths to the file keep the descriptor
+	bool shared = (wd >= 0 && (watches[wd] != node || nodes.alias[node] != NO_NODE));
+	if (wd >= 0 && !shared) {
+		stat_cache[wd % STAT_SLOTS].generation = 0;  // the descriptor may come back for another file
+	}
+	if(wd >= 0 && !shared && !replaying() && kevent(inotify_fd, eventlist, 
 				nevents, NULL, 0, NULL) < 0) {
-		userlog(LOG_ERR, "kevent add event failed for: %s, %s", path, strerror(errno));
-		err(EX_IOERR, "kevent add event failed for: %s",path);
+		userlog(LOG_ERR, "kevent remove watch: %s, error:%s", node_name(node), strerror(errno));
+		err(EX_OSERR, "kevent remove watch: %s, error:%s", node_name(node), strerror(errno));
+	}
+	for (int i=0; i<node_kid_count(node); i++) {
+		node_id kid = node_kid(node, i);
+		if (kid != NO_NODE) {
+			rm_node(kid, false, usage);
+		}
+	}
+
+	node_id parent = node_parent(node);
+	if (update_parent && parent != NO_NODE) {
+		for (int i=0; i<node_kid_count(parent); i++) {
+			if (node_kid(parent, i) == node) {
+				node_kids(parent)[i] = NO_NODE;
+				break;
+			}
+		}
+	}
+
+	if (shared) {
+		unlink_alias(node);
+	} else if (wd >= 0) {
+		forget_fingerprint(wd);
+		record_unwatch(wd);
+		drop_inode(wd);
+		if(close(wd) < 0) {
+			userlog(LOG_WARNING,"close: %s, %s", node_name(node), strerror(errno));
+		}
+		watches[wd] = NO_NODE;
+	}
+	unlist_dir(node);
+	node_count--;
+	memory_used -= node_memory(node);
+	if (usage != NULL) {
+		usage->bytes -= node_memory(node);
+	}
+	node_delete(node);
+}
+
+
+static void rm_watch(node_id node, bool update_parent) {
+	if (node == NO_NODE || node_name(node) == NULL) {
+		return;
+	}
+
+	root_usage* usage = usage_of(node);
+	rm_node(node, update_parent, usage);
+	account(usage, 0, 0);  // drops the entry of a root that is gone completely
+	if (memory_used < memory_limit) {
+		degrade_watermark = memory_limit;
+	}
+	restore_degraded();
+}
+
+
+static void list_dir(node_id node) {
+	nodes.older[node] = newest_dir;
+	nodes.newer[node] = NO_NODE;
+	if (newest_dir != NO_NODE) {
+		nodes.newer[newest_dir] = node;
 	} else {
-		userlog(LOG_DEBUG, "watching %s: %d", path, wd);
+		oldest_dir = node;
+	}
+	newest_dir = node;
+	nodes.flags[node] |= NODE_LISTED;
+}
+
+static void unlist_dir(node_id node) {
+	if (!(nodes.flags[node] & NODE_LISTED)) {
+		return;
+	}
+	node_id older = nodes.older[node], newer = nodes.newer[node];
+	if (older != NO_NODE) {
+		nodes.newer[older] = newer;
+	} else {
+		oldest_dir = newer;
+	}
+	if (newer != NO_NODE) {
+		nodes.older[newer] = older;
+	} else {
+		newest_dir = older;
+	}
+	nodes.older[node] = nodes.newer[node] = NO_NODE;
+	nodes.flags[node] &= ~NODE_LISTED;
+}
+
+// something happened in the directory: it goes to the newest end of the list, if it is on it
+static void touch_dir(node_id node) {
+	if ((nodes.flags[node] & NODE_LISTED) && node != newest_dir) {
+		unlist_dir(node);
+		list_dir(node);
+	}
+}
+
+static bool has_file_kids(node_id node) {
+	for (int i=0; i<node_kid_count(node); i++) {
+		node_id kid = node_kid(node, i);
+		if (kid != NO_NODE && !node_isdir(kid)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// unwatches files among the kids and compacts the kid list
+static void drop_file_kids(node_id node, root_usage* usage) {
+	for (int i=0; i<node_kid_count(node); i++) {
+		node_id kid = node_kid(node, i);
+		if (kid != NO_NODE && !node_isdir(kid)) {
+			rm_node(kid, false, usage);
+			node_kids(node)[i] = NO_NODE;
+		}
+	}
+	size_t kids_memory = node_kids_memory(node);
+	node_compact_kids(node);
+	account(usage, 0, kids_memory - node_kids_memory(node));
+}
+
+static void degrade(node_id node) {
+	degraded_dir* d = malloc(sizeof(degraded_dir));
+	if (d == NULL || array_push(degraded_dirs, d) == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		free(d);
+		return;
+	}
+	d->node = node;
+	d->wd = node_wd(node);
+	unlist_dir(node);
+	drop_file_kids(node, usage_of(node));
+	nodes.flags[node] |= NODE_DIRONLY;
+	userlog(LOG_INFO, "memory limit reached, watching directories only: %s", node_name(node));
+	output_event("DEGRADED", node_name(node));
+}
+
+// brings memory use down to 90% of the limit; picks directories with the oldest activity first
+static void enforce_memory_limit() {
+	size_t target = memory_limit / 10 * 9;
+	node_id next;
+	for (node_id node = oldest_dir; node != NO_NODE && memory_used > target; node = next) {
+		next = nodes.newer[node];
+		if (has_file_kids(node)) {
+			degrade(node);
+		} else {
+			unlist_dir(node);  // lost its files since
+		}
+	}
+
+	// when directories alone do not fit, look again only after noticeable growth
+	degrade_watermark = (memory_used > memory_limit ? memory_used + memory_limit / 16 : memory_limit);
+	if (memory_used > memory_limit) {
+		userlog(LOG_WARNING, "memory limit (%zu) exceeded by directory watches: %zu", memory_limit, memory_used);
+	}
+}
+
+
+static bool is_directory(struct dirent* entry, const char* path) {
+	if (entry->d_type == DT_DIR) {
+		return true;
+	}
+	else if (entry->d_type == DT_UNKNOWN) {  // filesystem doesn't support d_type
+		struct stat st;
+		return (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+	}
+	return false;
+}
+
+static bool is_ignored(const char* path, array* ignores) {
+
+	if(strstr(path, ".svn") != NULL || strstr(path, ".git") !=NULL || strstr(path, ".hg") != NULL) { /* hidden directory */
+		return true;
+	}
+
+	if (ignores != NULL) {
+		int pl = strlen(path);
+		for (int i=0; i<array_size(ignores); i++) {
+			const char* ignore = array_get(ignores, i);
+			int il = strlen(ignore);
+			if ((pl >= il && strncmp(path, ignore, il) == 0) ||
+					(strncmp(path+(pl-il),ignore,il)==0)) {
+				userlog(LOG_DEBUG, "path %s is under unwatchable %s - ignoring", path, ignore);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static uint64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static crawl_job* create_job(array* ignores, int isevent) {
+	crawl_job* job = calloc(1, sizeof(crawl_job));
+	if (job == NULL || (job->frames = array_create(DEFAULT_SUBDIR_COUNT)) == NULL) {
+		free(job);
+		return NULL;
+	}
+	if (ignores != NULL) {
+		if ((job->ignores = array_create(array_size(ignores) + 1)) == NULL) {
+			array_delete(job->frames);
+			free(job);
+			return NULL;
+		}
+		for (int i = 0; i < array_size(ignores); i++) {
+			array_push(job->ignores, strdup(array_get(ignores, i)));
+		}
+	}
+	job->isevent = isevent;
+	return job;
+}
+
+static bool push_frame(crawl_job* job, node_id node, DIR* dir) {
+	crawl_frame* frame = malloc(sizeof(crawl_frame));
+	if (frame == NULL || (frame->path = strdup(node_name(node))) == NULL) {
+		free(frame);
+		return false;
+	}
+	frame->wd = node_wd(node);
+	frame->node = node;
+	frame->dir = dir;
+	if (array_push(job->frames, frame) == NULL) {
+		free(frame->path);
+		free(frame);
+		return false;
+	}
+	return true;
+}
+
+static void pop_frame(crawl_job* job) {
+	crawl_frame* frame = array_pop(job->frames);
+	if (frame->dir != NULL && closedir(frame->dir) < 0) {
+		userlog(LOG_WARNING, "closedir: %s, %s", frame->path, strerror(errno));
+	}
+	free(frame->path);
+	free(frame);
+}
+
+static void delete_job(crawl_job* job) {
+	while (array_size(job->frames) > 0) {
+		pop_frame(job);
+	}
+	array_delete(job->frames);
+	array_delete_vs_data(job->ignores);
+	free(job);
+}
+
+/*
+ * Files kept without a descriptor have no events of their own: once a listing of their directory is
+ * complete, those it did not return are gone.
+ */
+static void sweep_unlisted(node_id dir) {
+	char path[PATH_MAX];
+	for (int i=0; i<node_kid_count(dir); i++) {
+		node_id kid = node_kid(dir, i);
+		if (kid == NO_NODE || node_wd(kid) >= 0) {
+			continue;
+		}
+		if (nodes.flags[kid] & NODE_SEEN) {
+			nodes.flags[kid] &= ~NODE_SEEN;
+			continue;
+		}
+		strcpy(path, node_name(kid));
+		count_churn(kid);
+		rm_watch(kid, false);
+		node_kids(dir)[i] = NO_NODE;
+		if (callback != NULL) {
+			(*callback)(path, NOTE_DELETE);
+		}
+	}
+}
+
+// the node a frame was created for, or NO_NODE if it was unwatched (and its id possibly reused) since
+static node_id frame_node(crawl_frame* frame) {
+	node_id node = frame->node;
+	return (node_alive(node, frame->wd) && strcmp(node_name(node), frame->path) == 0 ? node : NO_NODE);
+}
+
+// the node above the root of the tree a node is in, which holds the tree for a root of a session
+static node_id holder_of(node_id node) {
+	while (node_parent(node) != NO_NODE && node_name(node_parent(node)) != NULL) {
+		node = node_parent(node);
+	}
+	return node_parent(node);
+}
+
+// levels below the root
+static int node_depth(node_id node) {
+	int depth = 0;
+	while (node_parent(node) != NO_NODE && node_name(node_parent(node)) != NULL) {
+		node = node_parent(node);
+		depth++;
+	}
+	return depth;
+}
+
+/*
+ * Reads directories of the job until the stack shrinks to floor frames (*done is set) or the deadline passes.
+ * Returns ERR_ABORT if the crawl cannot go on; directories that cannot be opened are skipped.
+ */
+static int crawl_step(crawl_job* job, int floor, uint64_t deadline, bool* done) {
+	static char subdir[PATH_MAX+PATH_MAX+1];
+	int countdown = CRAWL_CLOCK_EVERY;
+
+	*done = false;
+	while (array_size(job->frames) > floor) {
+		if (--countdown == 0) {
+			if (now_ms() >= deadline) {
+				return 0;
+			}
+			countdown = CRAWL_CLOCK_EVERY;
+		}
+
+		crawl_frame* frame = array_get(job->frames, array_size(job->frames) - 1);
+		node_id node = frame_node(frame);
+		if (node == NO_NODE) {
+			pop_frame(job);
+			continue;
+		}
+
+		if (frame->dir == NULL) {
+			nodes.flags[node] &= ~NODE_RESCAN;
+			if ((frame->dir = opendir(frame->path)) == NULL) {
+				if (errno != EACCES && errno != ENOENT) {
+					userlog(LOG_ERR, "opendir(%s): %s", frame->path, strerror(errno));
+				}
+				pop_frame(job);
+				continue;
+			}
+		}
+
+		struct dirent* entry = readdir(frame->dir);
+		if (entry == NULL) {
+			record_listed(frame->wd);
+			sweep_unlisted(node);
+			pop_frame(job);
+			continue;
+		}
+		if (strncmp(entry->d_name, ".",PATH_MAX) == 0 || strncmp(entry->d_name, "..",PATH_MAX) == 0) {
+			continue;
+		}
+
+		strcpy(subdir, frame->path);
+		if (subdir[strlen(subdir) - 1] != '/') {
+			strcat(subdir, "/");
+		}
+		strncat(subdir, entry->d_name, PATH_MAX);
+
+		node_id added;
+		bool isdir = is_directory(entry, subdir);
+		record_entry(frame->wd, entry->d_name, isdir);
+		if (isdir) {
+			if (lazy_depth > 0 && (nodes.flags[node] & NODE_LAZY) && node_depth(node) >= lazy_depth) {
+				continue;
+			}
+			bool ignored = is_ignored(subdir, job->ignores);
+			if (ignored && strcmp(entry->d_name, ".git") == 0) {
+				vcs_watch(frame->path, holder_of(node));
+			}
+			int id = add_watch(subdir, node, 1, job->isevent, ignored, &added);
+			if (id == ERR_CONTINUE && access(subdir, F_OK) == 0) {
+				id = add_watch(subdir, node, 1, job->isevent, true, &added);  // not readable
+			}
+			if (id == ERR_ABORT) {
+				userlog(LOG_DEBUG,"add_watch nonignorable error code id:%d",id);
+				return id;
+			}
+			if (id < 0) {
+				continue;  // gone, or kept as a name only; the rest of the tree is watched without it
+			}
+			// directories watched before have their own re-scans; only new ones need to be descended into
+			if (added != NO_NODE && !push_frame(job, added, NULL)) {
+				userlog(LOG_ERR, "out of memory");
+				return ERR_ABORT;
+			}
+		} else if (nodes.flags[node] & (NODE_DIRONLY | NODE_COARSE | NODE_LAZY)) {
+			continue;
+		} else {
+			int id = add_watch(subdir, node, 0, job->isevent, false, &added);
+			if (id == ERR_CONTINUE && access(subdir, F_OK) == 0) {
+				id = add_watch(subdir, node, 0, job->isevent, true, &added);
+			}
+			if (id == ERR_ABORT) {
+				return ERR_ABORT;
+			}
+		}
+	}
+
+	*done = true;
+	return 0;
+}
+
+static void finish_root_job(crawl_job* job, int result) {
+	if (result < 0) {
+		bool alive = node_alive(job->root_node, job->root);
+		userlog(LOG_WARNING, "crawl of %s failed: %d", alive ? node_name(job->root_node) : "?", result);
+		if (alive) {
+			rm_watch(job->root_node, true);
+		}
+	}
+	if (job->callback != NULL) {
+		(*job->callback)(job->data, result < 0 ? result : job->root);
+	}
+	delete_job(job);
+}
+
+// runs pending crawls until the deadline; returns false on errors the loop cannot continue after
+static bool run_crawls(uint64_t deadline) {
+	bool done;
+	int result = crawl_step(rescan_job, 0, deadline, &done);
+	if (result < 0) {
+		return false;
+	} else if (!done) {
+		return true;
+	}
+	if (!run_estimates(deadline)) {
+		return true;
+	}
+
+	crawl_job* job;
+	while ((job = array_get(root_jobs, 0)) != NULL) {
+		result = crawl_step(job, 0, deadline, &done);
+		if (result == 0 && !done) {
+			return true;
+		}
+		array_remove_ordered(root_jobs, 0);
+		finish_root_job(job, result);
+		if (result == ERR_ABORT) {
+			return false;
+		}
+	}
+
+	// a directory that cannot be watched again is skipped; it is reported as dirty along with the rest
+	if (crawl_step(restore_job, 0, deadline, &done) < 0) {
+		return false;
+	} else if (!done) {
+		return true;
+	}
+	char* path;
+	while ((path = array_pop(restored)) != NULL) {
+		output_event("RECDIRTY", path);
+		free(path);
+	}
+	restore_degraded();
+	return true;
+}
+
+static bool crawls_pending() {
+	return array_size(rescan_job->frames) > 0 || estimates != NULL || array_size(root_jobs) > 0 ||
+			array_size(restore_job->frames) > 0;
+}
+
+static void crawl_slice(void* data) {
+	// with hot paths, kernel events that came in meanwhile are handled first: a hot one waits for no slice
+	bool drained = !has_hot_paths() || loop_drain_events();
+	crawl_timer = NULL;
+	if (!drained) {
+		loop_stop();
+		return;
+	}
+	stat_generation++;
+	if (!run_crawls(now_ms() + CRAWL_SLICE_MS)) {
+		loop_stop();
+	} else if (crawls_pending()) {
+		crawl_timer = loop_add_timer(0, &crawl_slice, NULL);
+	}
+}
+
+static void schedule_crawl() {
+	if (crawl_timer == NULL) {
+		crawl_timer = loop_add_timer(0, &crawl_slice, NULL);
+	}
+}
+
+// for SYNC; root crawls go on in the background
+bool finish_rescans() {
+	bool done;
+	return crawl_step(rescan_job, 0, UINT64_MAX, &done) >= 0;
+}
+
+bool finish_crawls() {
+	while (crawls_pending()) {
+		if (!run_crawls(UINT64_MAX)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool rescan(node_id node) {
+	if (nodes.flags[node] & NODE_RESCAN) {
+		return true;  // queued and not read yet; will see the change anyway
+	}
+	int floor = array_size(rescan_job->frames);
+	if (!push_frame(rescan_job, node, NULL)) {
+		userlog(LOG_ERR, "out of memory");
+		return false;
 	}
+	nodes.flags[node] |= NODE_RESCAN;
 
-	watch_node* node = table_get(watches, wd);
-	if (node != NULL) {
-		if (node->wd != wd || strcmp(node->name, path) != 0) {
-			userlog(LOG_ERR, "table error: collision (new %d:%s, existing %d:%s)", wd, path, node->wd, node->name);
-			return ERR_ABORT;
-		}
+	if (is_hot_path(node_name(node))) {
+		bool done;
+		return crawl_step(rescan_job, floor, UINT64_MAX, &done) >= 0;
+	}
+	schedule_crawl();
+	return true;
+}
 
-		return wd;
+// gives the last degraded directory its files back, if memory allows and no other restore is under way
+static void restore_degraded() {
+	if (array_size(degraded_dirs) == 0 || array_size(restore_job->frames) > 0 ||
+			memory_used >= memory_limit / 100 * RESTORE_PERCENT) {
+		return;
+	}
+	degraded_dir* d;
+	while ((d = array_pop(degraded_dirs)) != NULL) {
+		node_id node = d->node;
+		bool alive = node_alive(node, d->wd) && (nodes.flags[node] & NODE_DIRONLY);
+		free(d);
+		if (alive) {
+			userlog(LOG_INFO, "memory available, watching files again: %s", node_name(node));
+			nodes.flags[node] &= ~NODE_DIRONLY;
+			char* path = strdup(node_name(node));
+			if (path == NULL || array_push(restored, path) == NULL || !push_frame(restore_job, node, NULL)) {
+				userlog(LOG_ERR, "out of memory");
+			}
+			schedule_crawl();
+			return;
+		}
 	}
+}
 
-	node = calloc(1,sizeof(watch_node));
 
-	CHECK_NULL(node);
-	node->name = strdup(path);
-	CHECK_NULL(node->name);
-	node->wd = wd;
-	node->parent = parent;
-	node->isdir = isdir;
-	node->kids = NULL;
+static node_id coarse_top(node_id node) {
+	while (node_parent(node) != NO_NODE && (nodes.flags[node_parent(node)] & NODE_COARSE)) {
+		node = node_parent(node);
+	}
+	return node;
+}
 
+// whether a coarse_dir entry still refers to the topmost directory of a coarse subtree
+static bool is_coarse_top(coarse_dir* c) {
+	return node_alive(c->node, c->wd) && (nodes.flags[c->node] & NODE_COARSE) &&
+		!(nodes.flags[node_parent(c->node)] & NODE_COARSE);
+}
 
-	if(parent!=NULL) {
-		if(parent->kids == NULL) {
-			parent->kids = array_create(DEFAULT_SUBDIR_COUNT);
-			CHECK_NULL(parent->kids);
+static void report_dirty(void* data) {
+	dirty_timer = NULL;
+	for (int i=0; i<array_size(coarse_dirs); i++) {
+		coarse_dir* c = array_get(coarse_dirs, i);
+		if (is_coarse_top(c) && (nodes.flags[c->node] & NODE_DIRTY)) {
+			nodes.flags[c->node] &= ~NODE_DIRTY;
+			output_event("RECDIRTY", node_name(c->node));
 		}
-		CHECK_NULL(array_push(parent->kids, node));
 	}
+}
 
-
-	if (table_put(watches, wd, node) == NULL) {
-		userlog(LOG_ERR, "table error: unable to put (%d:%s)", wd, path);
-		return ERR_ABORT;
+static void mark_dirty(node_id node) {
+	nodes.flags[coarse_top(node)] |= NODE_DIRTY;
+	if (dirty_timer == NULL) {
+		dirty_timer = loop_add_timer(DIRTY_DELAY_MS, &report_dirty, NULL);
 	}
+}
 
-	if(isevent) {
-		output("CREATE\n%s\n",path);
+static void coarsen_tree(node_id node, root_usage* usage) {
+	drop_file_kids(node, usage);
+	for (int i=0; i<node_kid_count(node); i++) {
+		coarsen_tree(node_kid(node, i), usage);
 	}
-	return wd;
+	nodes.flags[node] |= NODE_COARSE;
 }
 
-
-static void rm_watch(int wd, bool update_parent) {
-	watch_node* node = table_get(watches, wd);
-	if (node == NULL) {
+static void coarsen(node_id node) {
+	coarse_dir* c = malloc(sizeof(coarse_dir));
+	if (c == NULL || array_push(coarse_dirs, c) == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		free(c);
 		return;
 	}
+	c->node = node;
+	c->wd = node_wd(node);
+	c->quiet = 0;
+	userlog(LOG_INFO, "high churn (%u events), watching directories only: %s", nodes.churn[node], node_name(node));
+	coarsen_tree(node, usage_of(node));
+}
 
-	userlog(LOG_DEBUG, "unwatching %s: %d (%p)", node->name, node->wd, node);
-	struct kevent eventlist[2];
-	int nevents=0;
-	EV_SET(&eventlist[0], wd, EVFILT_VNODE, EV_DELETE, 
-			NOTE_DELETE | NOTE_WRITE | NOTE_RENAME
-			| NOTE_EXTEND | NOTE_ATTRIB | NOTE_REVOKE,
-			0, NULL);
-	nevents++;
-
-	if(kevent(inotify_fd, eventlist, 
-				nevents, NULL, 0, NULL) < 0) {
-		userlog(LOG_ERR, "kevent remove watch: %s, error:%s", node->name, strerror(errno));
-		err(EX_OSERR, "kevent remove watch: %s, error:%s", node->name, strerror(errno));
+static bool restore_tree(node_id node, uint16_t flags) {
+	nodes.flags[node] &= ~flags;
+	if (!push_frame(restore_job, node, NULL)) {
+		return false;
 	}
-	for (int i=0; i<array_size(node->kids); i++) {
-		watch_node* kid = array_get(node->kids, i);
-		if (kid != NULL) {
-			rm_watch(kid->wd, false);
+	for (int i=0; i<node_kid_count(node); i++) {
+		node_id kid = node_kid(node, i);
+		if (kid != NO_NODE && node_isdir(kid) && !(nodes.flags[kid] & NODE_SKIPPED) && !restore_tree(kid, flags)) {
+			return false;
 		}
 	}
+	return true;
+}
 
-	if (update_parent && node->parent != NULL) {
-		for (int i=0; i<array_size(node->parent->kids); i++) {
-			if (array_get(node->parent->kids, i) == node) {
-				array_put(node->parent->kids, i, NULL);
-				break;
-			}
-		}
+static void restore(node_id node) {
+	userlog(LOG_INFO, "churn is over, watching files again: %s", node_name(node));
+	char* path = strdup(node_name(node));
+	if (path == NULL || array_push(restored, path) == NULL || !restore_tree(node, NODE_COARSE | NODE_DIRTY)) {
+		userlog(LOG_ERR, "out of memory");
+	}
+	schedule_crawl();
+}
+
+
+/*
+ * Lazy watching: with a lazy depth set, roots start out with directories only, down to that many levels
+ * below the root (0: all of them). The client expands the subtrees it loads: their files get watched, as do
+ * directories below the depth, and a RECDIRTY follows once that is done; collapsing drops the files again.
+ */
+void set_lazy_depth(int depth) {
+	lazy_depth = depth;
+}
+
+void expand(node_id node) {
+	userlog(LOG_INFO, "expanding %s", node_name(node));
+	char* path = strdup(node_name(node));
+	if (path == NULL || array_push(restored, path) == NULL || !restore_tree(node, NODE_LAZY)) {
+		userlog(LOG_ERR, "out of memory");
 	}
+	schedule_crawl();
+}
 
-	free(node->name);
-	array_delete(node->kids);
-	free(node);
-	table_put(watches, wd, NULL);
-	if(close(wd) < 0) {
-		userlog(LOG_WARNING,"close: %s, %s", node->name, strerror(errno));
+static void collapse_tree(node_id node, root_usage* usage) {
+	drop_file_kids(node, usage);
+	for (int i=0; i<node_kid_count(node); i++) {
+		node_id kid = node_kid(node, i);
+		if (!is_expanded(node_name(kid))) {
+			collapse_tree(kid, usage);
+		}
 	}
+	nodes.flags[node] |= NODE_LAZY;
 }
 
+// directories below the lazy depth stay watched, and so do subtrees another session has expanded
+void collapse(node_id node) {
+	userlog(LOG_INFO, "collapsing %s", node_name(node));
+	collapse_tree(node, usage_of(node));
+}
 
-static bool is_directory(struct dirent* entry, const char* path) {
-	if (entry->d_type == DT_DIR) {
-		return true;
+// the innermost directory with high churn; roots and directories the client works in keep their files
+static bool should_coarsen(node_id node) {
+	if (!node_isdir(node) || nodes.churn[node] < CHURN_LIMIT || (nodes.flags[node] & NODE_COARSE) ||
+			node_parent(node) == NO_NODE || node_name(node_parent(node)) == NULL || is_hot_path(node_name(node))) {
+		return false;
 	}
-	else if (entry->d_type == DT_UNKNOWN) {  // filesystem doesn't support d_type
-		struct stat st;
-		return (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+	for (int i=0; i<node_kid_count(node); i++) {
+		node_id kid = node_kid(node, i);
+		if (kid != NO_NODE && node_isdir(kid) && nodes.churn[kid] >= CHURN_LIMIT) {
+			return false;
+		}
 	}
-	return false;
+	return true;
 }
 
-static bool is_ignored(const char* path, array* ignores) {
+static void churn_window(void* data) {
+	churn_timer = NULL;
 
-	if(strstr(path, ".svn") != NULL || strstr(path, ".git") !=NULL || strstr(path, ".hg") != NULL) { /* hidden directory */
-		return true;
+	for (int i=0; i<array_size(coarse_dirs); ) {
+		coarse_dir* c = array_get(coarse_dirs, i);
+		if (is_coarse_top(c)) {
+			c->quiet = (nodes.churn[c->node] < CHURN_QUIET ? c->quiet + 1 : 0);
+			if (c->quiet < CHURN_QUIET_WINDOWS) {
+				i++;
+				continue;
+			}
+			restore(c->node);
+		}
+		array_remove(coarse_dirs, i);
+		free(c);
 	}
 
-	if (ignores != NULL) {
-		int pl = strlen(path);
-		for (int i=0; i<array_size(ignores); i++) {
-			const char* ignore = array_get(ignores, i);
-			int il = strlen(ignore);
-			if ((pl >= il && strncmp(path, ignore, il) == 0) ||
-					(strncmp(path+(pl-il),ignore,il)==0)) {
-				userlog(LOG_DEBUG, "path %s is under unwatchable %s - ignoring", path, ignore);
-				return true;
-			}
+	// kids are checked against their own counters, so those are reset in a second pass
+	for (int i=0; i<array_size(churned); i++) {
+		node_id node = PTR_NODE(array_get(churned, i));
+		if (node_name(node) != NULL && should_coarsen(node)) {
+			coarsen(node);
 		}
 	}
+	void* node;
+	while ((node = array_pop(churned)) != NULL) {
+		nodes.churn[PTR_NODE(node)] = 0;
+	}
 
-	return false;
+	if (array_size(coarse_dirs) > 0) {
+		churn_timer = loop_add_timer(CHURN_WINDOW_MS, &churn_window, NULL);
+	}
+}
+
+static void count_churn(node_id node) {
+	for (node_id dir = (node_isdir(node) ? node : node_parent(node)); dir != NO_NODE && node_name(dir) != NULL;
+			dir = node_parent(dir)) {
+		if (nodes.churn[dir]++ == 0 && array_push(churned, NODE_PTR(dir)) == NULL) {
+			nodes.churn[dir] = 0;  // out of memory: not counted
+		}
+	}
+	if (churn_timer == NULL) {
+		churn_timer = loop_add_timer(CHURN_WINDOW_MS, &churn_window, NULL);
+	}
 }
 
-static int walk_tree(const char* path, watch_node* parent, array* ignores, int isevent) {
+/*
+ * Starts watching a root: the root itself is watched right away and its id returned,
+ * the rest of the tree is crawled in the background and reported via callback.
+ */
+int watch(const char* root, node_id parent, array* ignores, crawl_callback callback, void* data) {
+	char buf[PATH_MAX];
+	const char* path = realpath(root, buf);
+	if (path == NULL) {
+		path = root;
+	}
 
 	if (is_ignored(path, ignores)) {
 		return ERR_IGNORE;
 	}
 
+	node_id added;
+	int id;
 	DIR* dir = opendir(path);
 	if (dir == NULL) {
 		if (errno == EACCES) {
 			return ERR_IGNORE;
-		} else if (errno == ENOTDIR) {  // flat root
-			return add_watch(path, parent, 0, isevent);
+		} else if (errno != ENOTDIR) {
+			userlog(LOG_ERR, "opendir(%s): %s", path, strerror(errno));
+			return ERR_IGNORE;
 		}
-		userlog(LOG_ERR, "opendir(%s): %s", path, strerror(errno));
-		return ERR_IGNORE;
+		id = add_watch(path, parent, 0, 0, false, &added);  // flat root
+	} else {
+		id = add_watch(path, parent, 1, 0, false, &added);
 	}
-
-	int id = add_watch(path, parent, 1, isevent);
-	if (id < 0 && id != ERR_IGNORE) {
-		userlog(LOG_DEBUG,"add_watch nonignorable error code id:%d",id);
-		if(closedir(dir) < 0) {
-			userlog(LOG_WARNING,"closedir: %s, %s", dir, strerror(errno));
+	if (id < 0) {
+		if (dir != NULL) {
+			closedir(dir);
 		}
 		return id;
 	}
+	if (added == NO_NODE) {
+		added = node_at(id);  // the path was watched under this parent already
+	}
 
-	struct dirent* entry;
-	char subdir[PATH_MAX+PATH_MAX+1];
+	crawl_job* job = create_job(ignores, 0);
+	if (job == NULL || (dir != NULL && !push_frame(job, added, dir)) || array_push(root_jobs, job) == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		if (job != NULL) {
+			delete_job(job);
+		} else if (dir != NULL) {
+			closedir(dir);
+		}
+		return ERR_ABORT;
+	}
+	job->root = id;
+	job->root_node = added;
+
+	// a root inside a work tree has the repository above it
+	char work_tree[PATH_MAX];
+	strncpy(work_tree, path, PATH_MAX - 1);
+	work_tree[PATH_MAX - 1] = '\0';
+	for (char* slash; (slash = strrchr(work_tree, '/')) != NULL; ) {
+		*(slash == work_tree ? slash + 1 : slash) = '\0';
+		vcs_watch(work_tree, parent);
+		if (slash == work_tree) {
+			break;
+		}
+	}
+	job->callback = callback;
+	job->data = data;
+	schedule_crawl();
+	return id;
+}
+
+
+// forgets a root crawl that is still running; its callback will not be called
+void cancel_watch(void* data) {
+	for (int i = 0; i < array_size(root_jobs); i++) {
+		crawl_job* job = array_get(root_jobs, i);
+		if (job->data == data) {
+			array_remove_ordered(root_jobs, i);
+			delete_job(job);
+			return;
+		}
+	}
+}
 
-	strcpy(subdir, path);
 
-	if (subdir[strlen(subdir) - 1] != '/') {
-		strcat(subdir, "/");
+/*
+ * Estimates for a prospective root: the tree is walked like a crawl would, but directories are only listed,
+ * nothing is opened or registered. Where a directory has more than ESTIMATE_SAMPLE subdirectories, only every
+ * n-th one is walked and counted n times. The walk runs in crawl slices, after re-scans and before root
+ * crawls, and stops after ESTIMATE_BUDGET_MS of listing. Crawl time is the listing time scaled up by
+ * sampling, plus ESTIMATE_WATCH_US per descriptor opened and registered.
+ */
+#define ESTIMATE_SAMPLE 64
+#define ESTIMATE_BUDGET_MS 1000
+#define ESTIMATE_WATCH_US 10
+
+typedef struct {
+	char* path;
+	unsigned long weight;
+} estimate_frame;
+
+typedef struct __estimate_job {
+	char* root;
+	array* frames;     // estimate_frame; a stack, like the frames of a crawl
+	array* ignores;
+	bool file_fds;
+	bool failed;       // the root is not there, or out of memory
+	uint64_t listing_us;
+	unsigned long listed, weighted;
+	tree_estimate estimate;
+	estimate_callback callback;
+	void* data;
+	struct __estimate_job* next;
+} estimate_job;
+
+static bool push_estimate(array* frames, const char* path, unsigned long weight) {
+	estimate_frame* frame = malloc(sizeof(estimate_frame));
+	if (frame == NULL || (frame->path = strdup(path)) == NULL || array_push(frames, frame) == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		if (frame != NULL) {
+			free(frame->path);
+		}
+		free(frame);
+		return false;
 	}
+	frame->weight = weight;
+	return true;
+}
 
-	char* p = subdir + strlen(subdir);
+// lists one directory into the estimate and pushes the subdirectories to walk
+static bool estimate_dir(estimate_frame* frame, bool file_fds, array* ignores, array* frames, tree_estimate* e) {
+	static char subdir[PATH_MAX+PATH_MAX+1];
+	DIR* dir = opendir(frame->path);
+	if (dir == NULL) {
+		return true;
+	}
+	array* subdirs = array_create(DEFAULT_SUBDIR_COUNT);
+	if (subdirs == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		closedir(dir);
+		return false;
+	}
 
+	uint32_t kids = 0;
+	struct dirent* entry;
 	while ((entry = readdir(dir)) != NULL) {
-		if (strncmp(entry->d_name, ".",PATH_MAX) == 0 || strncmp(entry->d_name, "..",PATH_MAX) == 0) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
 			continue;
 		}
+		strcpy(subdir, frame->path);
+		if (subdir[strlen(subdir) - 1] != '/') {
+			strcat(subdir, "/");
+		}
+		strncat(subdir, entry->d_name, PATH_MAX);
 
-		strncpy(p, entry->d_name,PATH_MAX);
-		if(is_directory(entry, subdir)) {
-			int subdir_id = walk_tree(subdir, table_get(watches, id), ignores, isevent);
-			if (subdir_id < 0 && subdir_id != ERR_IGNORE) {
-				rm_watch(id, true);
-				id = subdir_id;
-				break;
+		if (is_directory(entry, subdir)) {
+			char* copy;
+			if (is_ignored(subdir, ignores)) {
+				continue;
+			}
+			if ((copy = strdup(subdir)) == NULL || array_push(subdirs, copy) == NULL) {
+				userlog(LOG_ERR, "out of memory");
+				free(copy);
+				closedir(dir);
+				array_delete_vs_data(subdirs);
+				return false;
 			}
 		} else {
-			add_watch(subdir, table_get(watches, id), 0, isevent);
+			e->files += frame->weight;
+			e->fds += (file_fds ? frame->weight : 0);
+			e->memory += frame->weight * node_estimate(strlen(subdir), 0);
 		}
+		kids++;
+	}
+	closedir(dir);
+
+	e->dirs += frame->weight;
+	e->fds += frame->weight;
+	e->memory += frame->weight * node_estimate(strlen(frame->path), kids);
+
+	int count = array_size(subdirs);
+	int step = (count > ESTIMATE_SAMPLE ? (count + ESTIMATE_SAMPLE - 1) / ESTIMATE_SAMPLE : 1);
+	e->sampled |= (step > 1);
+	bool ok = true;
+	for (int i = 0; i < count && ok; i += step) {
+		// the last sample may stand for fewer siblings
+		unsigned long weight = frame->weight * (i + step <= count ? step : count - i);
+		ok = push_estimate(frames, array_get(subdirs, i), weight);
 	}
+	array_delete_vs_data(subdirs);
+	return ok;
+}
 
-	if(closedir(dir) < 0 ) {
-		userlog(LOG_WARNING,"closedir: %s, %s", dir, strerror(errno));
+static void delete_estimate(estimate_job* job) {
+	estimate_frame* frame;
+	while ((frame = array_pop(job->frames)) != NULL) {
+		free(frame->path);
+		free(frame);
 	}
+	array_delete(job->frames);
+	array_delete_vs_data(job->ignores);
+	free(job->root);
+	free(job);
+}
 
-	return id;
+// reports the estimate, or the lack of one; the job is gone after that
+static void finish_estimate(estimate_job* job) {
+	bool ok = !job->failed;
+	tree_estimate* e = &job->estimate;
+	e->complete = ok && array_size(job->frames) == 0;
+	uint64_t listing_ms = job->listing_us * job->weighted / (job->listed > 0 ? job->listed : 1) / 1000;
+	e->crawl_ms = listing_ms + (uint64_t) e->fds * ESTIMATE_WATCH_US / 1000;
+	if (ok) {
+		userlog(LOG_INFO, "estimate of %s: %lu directories, %lu files%s", job->root, e->dirs, e->files,
+				(e->complete ? "" : " (incomplete)"));
+	}
+	(*job->callback)(job->data, job->root, ok ? e : NULL);
+	delete_estimate(job);
 }
 
+// lists directories of the job until the deadline; true once the walk is over
+static bool estimate_step(estimate_job* job, uint64_t deadline) {
+	uint64_t start = now_us();
+	while (array_size(job->frames) > 0 && !job->failed && now_ms() < deadline &&
+			job->listing_us + (now_us() - start) < ESTIMATE_BUDGET_MS * 1000) {
+		estimate_frame* frame = array_pop(job->frames);
+		job->failed = !estimate_dir(frame, job->file_fds, job->ignores, job->frames, &job->estimate);
+		job->listed++;
+		job->weighted += frame->weight;
+		free(frame->path);
+		free(frame);
+	}
+	job->listing_us += now_us() - start;
+	return job->failed || array_size(job->frames) == 0 || job->listing_us >= ESTIMATE_BUDGET_MS * 1000;
+}
 
-int watch(const char* root, watch_node* parent, array* ignores) {
-	char buf[PATH_MAX];
-	const char* normalized = realpath(root, buf);
-	return walk_tree((normalized != NULL ? normalized : root), parent, ignores, 0);
+// runs estimates in the order requested until the deadline; false while one is still going
+static bool run_estimates(uint64_t deadline) {
+	estimate_job* job;
+	while ((job = estimates) != NULL) {
+		if (!estimate_step(job, deadline)) {
+			return false;
+		}
+		estimates = job->next;
+		if (estimates == NULL) {
+			last_estimate = NULL;
+		}
+		finish_estimate(job);
+	}
+	return true;
 }
 
+/*
+ * Starts walking root without watching anything; file_fds tells whether files would get descriptors of
+ * their own. The ignores are taken over. Callbacks come in the order of the requests; one gets NULL if the
+ * root is ignored or not there. Returns false if out of memory.
+ */
+bool estimate_tree(const char* root, bool file_fds, array* ignores, estimate_callback callback, void* data) {
+	estimate_job* job = calloc(1, sizeof(estimate_job));
+	if (job == NULL || (job->root = strdup(root)) == NULL || (job->frames = array_create(DEFAULT_SUBDIR_COUNT)) == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		if (job != NULL) {
+			free(job->root);
+		}
+		free(job);
+		array_delete_vs_data(ignores);
+		return false;
+	}
+	job->ignores = ignores;
+	job->file_fds = file_fds;
+	job->callback = callback;
+	job->data = data;
+
+	struct stat st;
+	if (is_ignored(root, ignores) || stat(root, &st) != 0) {
+		job->failed = true;
+	}
+	else if (!S_ISDIR(st.st_mode)) {  // flat root
+		tree_estimate* e = &job->estimate;
+		e->files = e->fds = 1;
+		e->memory = node_estimate(strlen(root), 0);
+	}
+	else if (!push_estimate(job->frames, root, 1)) {
+		delete_estimate(job);
+		return false;
+	}
 
-void unwatch(int id) {
-	rm_watch(id, true);
+	if (last_estimate != NULL) {
+		last_estimate->next = job;
+	} else {
+		estimates = job;
+	}
+	last_estimate = job;
+	schedule_crawl();
+	return true;
 }
 
-static bool process_inotify_event(struct kevent* event) {
-	watch_node* node = table_get(watches, event->ident);
-	if (node == NULL) {
-		return true;
+// forgets the running estimates of the requester; their callbacks will not be called
+void cancel_estimates(void* data) {
+	estimate_job** link = &estimates;
+	last_estimate = NULL;
+	while (*link != NULL) {
+		estimate_job* job = *link;
+		if (job->data == data) {
+			*link = job->next;
+			delete_estimate(job);
+		} else {
+			last_estimate = job;
+			link = &job->next;
+		}
 	}
-	userlog(LOG_DEBUG, "inotify: ident=%d filter=%d flags=%d fflags=%d data=%d udata=%d name=%s",
-			event->ident, event->filter , event->flags, event->fflags, event->data, event->udata , node->name);
+}
+
+
+// looks a path up in the tree under parent; NO_NODE if it is not watched
+node_id find_node(node_id parent, const char* path) {
+	int pl = strlen(path);
+	while (parent != NO_NODE) {
+		node_id next = NO_NODE;
+		for (int i = 0; i < node_kid_count(parent); i++) {
+			node_id kid = node_kid(parent, i);
+			if (kid == NO_NODE) {
+				continue;
+			}
+			const char* name = node_name(kid);
+			int l = strlen(name);
+			if (l <= pl && strncmp(name, path, l) == 0 && (path[l] == '\0' || path[l] == '/')) {
+				if (path[l] == '\0') {
+					return kid;
+				}
+				next = kid;
+				break;
+			}
+		}
+		parent = next;
+	}
+	return NO_NODE;
+}
+
+// attributes of a path being reported; paths without a descriptor of their own are looked up with stat()
+bool event_stat(const char* path, struct stat* st) {
+	node_id node = event_node;
+	int wd = (node != NO_NODE && strcmp(node_name(node), path) == 0 ? node_wd(node) : -1);
+	if (wd < 0) {
+		return stat(path, st) == 0;
+	}
+	stat_slot* slot = &stat_cache[wd % STAT_SLOTS];
+	if (slot->wd != wd || slot->generation != stat_generation) {
+		slot->wd = wd;
+		slot->generation = stat_generation;
+		slot->ok = (fstat(wd, &slot->st) == 0);
+	}
+	*st = slot->st;
+	return slot->ok;
+}
+
+
+void unwatch(node_id node) {
+	rm_watch(node, true);
+}
+
+
+static void check_settled(void* data) {
+	settle_timer = NULL;
+	stat_generation++;
+	for (int i=0; i<array_size(settling); i++) {
+		int wd = (int) (intptr_t) array_get(settling, i);
+		node_id node = node_at(wd);
+		if (node != NO_NODE && fingerprint_changed(wd) && callback != NULL) {
+			for (; node != NO_NODE; node = nodes.alias[node]) {
+				if (!(nodes.flags[node] & NODE_NOCHANGE) && !has_twin(node, true, NODE_NOCHANGE)) {
+					event_node = node;
+					(*callback)(nodes.name[node], NOTE_WRITE);
+					event_node = NO_NODE;
+				}
+			}
+		}
+	}
+	array_delete(settling);
+	settling = NULL;
+}
+
+
+static void settle(int wd) {
+	if (settling == NULL && (settling = array_create(DEFAULT_SUBDIR_COUNT)) == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		return;
+	}
+	if (array_push(settling, (void*) (intptr_t) wd) == NULL) {
+		userlog(LOG_ERR, "out of memory");
+		return;
+	}
+	if (settle_timer == NULL) {
+		settle_timer = loop_add_timer(SETTLE_MS, &check_settled, NULL);
+	}
+}
+
+// for SYNC: files waiting to settle are compared and dirty coarse directories reported without the delay
+void flush_delayed_events() {
+	if (settle_timer != NULL) {
+		loop_cancel_timer(settle_timer);
+		check_settled(NULL);
+	}
+	if (dirty_timer != NULL) {
+		loop_cancel_timer(dirty_timer);
+		report_dirty(NULL);
+	}
+}
+
+static bool is_hot_event(struct kevent* event);
+
+/*
+ * Handles the event for one path of the file; *reported holds the events reported for the path so far
+ * (by a twin) and gets those reported here.
+ */
+static bool process_node_event(node_id node, struct kevent* event, int event_fflags, int* reported) {
 	char path[PATH_MAX];
-	strcpy(path, node->name);
-	if (node->isdir && (event->filter == EVFILT_VNODE) && 
-			((event->fflags & NOTE_WRITE) || (event->fflags & NOTE_EXTEND) || 
-			 (event->fflags & NOTE_LINK))) {
-		userlog(LOG_DEBUG, "write detected in path:%s, fd:%d, filter:%d, fflags:%d", path, event->ident, event->filter, event->fflags);
-		int result = walk_tree(path, node->parent, NULL, 1);
-		if (result < 0 && result != ERR_IGNORE) {
+	strcpy(path, node_name(node));
+	bool isdir = node_isdir(node);
+	if (isdir) {
+		touch_dir(node);
+	} else if (node_parent(node) != NO_NODE) {
+		touch_dir(node_parent(node));
+	}
+	int fflags = event_fflags & ~*reported;
+	if (nodes.flags[node] & NODE_NOCHANGE) {
+		fflags &= ~(NOTE_WRITE | NOTE_EXTEND);
+	}
+	if (nodes.flags[node] & NODE_NOSTATS) {
+		fflags &= ~NOTE_ATTRIB;
+	}
+	count_churn(node);
+	if (nodes.flags[node] & NODE_COARSE) {
+		// only the removal of the coarse directory itself is reported as is
+		mark_dirty(node);
+		fflags &= (coarse_top(node) == node ? NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE : 0);
+	}
+	if (!isdir && (fflags & (NOTE_WRITE | NOTE_EXTEND)) && fingerprinted(node_wd(node)) &&
+			!(fflags & (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE)) && !(has_hot_paths() && is_hot_event(event))) {
+		fflags &= ~(NOTE_WRITE | NOTE_EXTEND);
+		if (touch_fingerprint(node_wd(node))) {
+			settle(node_wd(node));
+		}
+	}
+	if (isdir && (event->filter == EVFILT_VNODE) && 
+			((event_fflags & NOTE_WRITE) || (event_fflags & NOTE_EXTEND) || 
+			 (event_fflags & NOTE_LINK))) {
+		userlog(LOG_DEBUG, "write detected in path:%s, fd:%d, filter:%d, fflags:%d", path, event->ident, event->filter, event_fflags);
+		if (!rescan(node)) {
 			return false;
 		}
 	}
 	if((event->filter == EVFILT_VNODE) && 
-			(((event->fflags & NOTE_DELETE) || (event->fflags & NOTE_REVOKE))
-			 || (event->fflags & NOTE_RENAME))) {
-		userlog(LOG_DEBUG, "remove, revoke or rename in path:%s, fd:%d, filter:%d, fflags:%d", path, event->ident, event->filter, event->fflags);
-		if (node->isdir) {
-			for (int i=0; i<array_size(node->kids); i++) {
-				watch_node* kid = array_get(node->kids, i);
-				if (kid != NULL 
-						&& strncmp(kid->name, path,PATH_MAX) == 0) {
-					userlog(LOG_DEBUG,"remove watch for:%s, wd: %d",kid->name, kid->wd);
-					rm_watch(kid->wd, false);
-					array_put(node->kids, i, NULL);
+			(((event_fflags & NOTE_DELETE) || (event_fflags & NOTE_REVOKE))
+			 || (event_fflags & NOTE_RENAME))) {
+		userlog(LOG_DEBUG, "remove, revoke or rename in path:%s, fd:%d, filter:%d, fflags:%d", path, event->ident, event->filter, event_fflags);
+		if (isdir) {
+			for (int i=0; i<node_kid_count(node); i++) {
+				node_id kid = node_kid(node, i);
+				if (kid != NO_NODE 
+						&& strncmp(node_name(kid), path,PATH_MAX) == 0) {
+					userlog(LOG_DEBUG,"remove watch for:%s, wd: %d",node_name(kid), node_wd(kid));
+					rm_watch(kid, false);
+					node_kids(node)[i] = NO_NODE;
 					break;
 				}
 			}
 		}
-		rm_watch(node->wd,true);
+		rm_watch(node,true);
+	}
+
+	if (callback != NULL && fflags != 0) {
+		event_node = (node_name(node) != NULL ? node : NO_NODE);  // gone along with the file
+		(*callback)(path, fflags);
+		event_node = NO_NODE;
+	}
+	*reported |= fflags;
+	return true;
+}
+
+/*
+ * Hands an event to every path of the file. A deleted or renamed name only concerns the aliases that
+ * no longer lead to the file; for the others the link count changed, an attribute change.
+ */
+static bool process_inotify_event(struct kevent* event) {
+	node_id node = node_at(event->ident);
+	if (node == NO_NODE) {
+		return true;
+	}
+	userlog(LOG_DEBUG, "inotify: ident=%d filter=%d flags=%d fflags=%d data=%d udata=%d name=%s",
+			event->ident, event->filter , event->flags, event->fflags, event->data, event->udata , node_name(node));
+	if (nodes.alias[node] == NO_NODE) {
+		int reported = 0;
+		return process_node_event(node, event, event->fflags, &reported);
+	}
+
+	int count = 0;
+	for (node_id n = node; n != NO_NODE; n = nodes.alias[n]) {
+		if (count == alias_buf_len) {
+			int len = (alias_buf_len > 0 ? alias_buf_len * 2 : 16);
+			alias_ref* buf = realloc(alias_buf, sizeof(alias_ref) * len);
+			if (buf == NULL) {
+				userlog(LOG_ERR, "out of memory");
+				return false;
+			}
+			alias_buf = buf;
+			alias_buf_len = len;
+		}
+		alias_ref* ref = &alias_buf[count];
+		ref->node = n;
+		ref->twin = count;
+		ref->reported = 0;
+		for (int i = 0; i < count; i++) {
+			if (strcmp(node_name(alias_buf[i].node), node_name(n)) == 0) {
+				ref->twin = i;
+				break;
+			}
+		}
+		count++;
 	}
 
-	if (callback != NULL) {
-		(*callback)(path, event->fflags);
+	int wd = event->ident;
+	struct stat file, st;
+	bool unlinked = (event->fflags & (NOTE_DELETE | NOTE_RENAME)) && !(event->fflags & NOTE_REVOKE) &&
+		fstat(wd, &file) == 0;
+	for (int i = 0; i < count; i++) {
+		node_id n = alias_buf[i].node;
+		if (!node_alive(n, wd)) {
+			continue;  // removed along with an alias processed before
+		}
+		int fflags = event->fflags;
+		if (unlinked && stat(node_name(n), &st) == 0 && st.st_dev == file.st_dev && st.st_ino == file.st_ino) {
+			fflags = (fflags & ~(NOTE_DELETE | NOTE_RENAME)) | NOTE_ATTRIB;
+		}
+		if (fflags != 0 && !process_node_event(n, event, fflags, &alias_buf[alias_buf[i].twin].reported)) {
+			return false;
+		}
 	}
 	return true;
 }
@@ -472,16 +1993,67 @@ void decode_event(struct kevent* event)
 
 }
 
-bool process_inotify_input() {
-	size_t len = kevent(inotify_fd,NULL,0,event_buf,2048,NULL);
-	if (len < 0) {
-		userlog(LOG_ERR, "read: %s", strerror(errno));
+static struct kevent* bulk_buf = NULL;
+static int bulk_buf_len = 0;
+
+static bool is_hot_event(struct kevent* event) {
+	if (event->filter != EVFILT_VNODE) {
 		return false;
 	}
+	node_id node = node_at(event->ident);
+	return node != NO_NODE && is_hot_path(node_name(node));
+}
+
+/*
+ * Moves events under hot paths to the front of the batch (keeping the relative order of both lanes),
+ * so their re-scans and output are not queued behind bulk changes like build output.
+ */
+static void prioritize_hot_events(struct kevent* events, int count) {
+	if (bulk_buf_len < count) {
+		struct kevent* buf = realloc(bulk_buf, count * sizeof(struct kevent));
+		if (buf == NULL) {
+			return;  // the batch is still processed, just in arrival order
+		}
+		bulk_buf = buf;
+		bulk_buf_len = count;
+	}
+
+	int hot = 0, bulk = 0;
+	for (int i = 0; i < count; i++) {
+		if (is_hot_event(&events[i])) {
+			events[hot++] = events[i];
+		} else {
+			bulk_buf[bulk++] = events[i];
+		}
+	}
+	memcpy(events + hot, bulk_buf, bulk * sizeof(struct kevent));
+}
+
+/*
+ * Files are fingerprinted on their first write, which is reported as is: only files being worked on are read.
+ * Writes under hot paths are not held back to settle either; they too leave the fingerprint to compare with.
+ */
+static void refresh_fingerprint(struct kevent* event) {
+	node_id node = node_at(event->ident);
+	if (node != NO_NODE && !node_isdir(node) && (event->fflags & (NOTE_WRITE | NOTE_EXTEND)) &&
+			!(event->fflags & (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE)) &&
+			(!fingerprinted(event->ident) || (has_hot_paths() && is_hot_event(event)))) {
+		remember_fingerprint(event->ident);
+	}
+}
+
+bool process_inotify_events(struct kevent* events, int count) {
+	stat_generation++;
+	record_events(events, count);
+	if (has_hot_paths()) {
+		prioritize_hot_events(events, count);
+	}
 
-	int i = 0;
-	while (i < len) {
-		struct kevent* event = &event_buf[i];
+	for (int i = 0; i < count; i++) {
+		struct kevent* event = &events[i];
+		if (event->filter != EVFILT_VNODE) {
+			continue;
+		}
 		if(event->flags & EV_ERROR) {
 			userlog(LOG_ERR,"kevent: error returned in kevent",strerror(event->data));
 			return false;
@@ -489,10 +2061,12 @@ bool process_inotify_input() {
 		if(level == LOG_DEBUG) {
 			decode_event(event);
 		}
-		i++;
 		if (!process_inotify_event(event)) {
 			return false;
 		}
+		if (fingerprints_enabled()) {
+			refresh_fingerprint(event);
+		}
 	}
 
 	return true;
@@ -500,9 +2074,57 @@ bool process_inotify_input() {
 
 
 void close_inotify() {
-	if (watches != NULL) {
-		table_delete(watches);
+	crawl_job* job;
+	while ((job = array_pop(root_jobs)) != NULL) {
+		delete_job(job);
+	}
+	array_delete(root_jobs);
+	root_jobs = NULL;
+	while (estimates != NULL) {
+		estimate_job* next = estimates->next;
+		delete_estimate(estimates);
+		estimates = next;
+	}
+	last_estimate = NULL;
+	if (rescan_job != NULL) {
+		delete_job(rescan_job);
+		rescan_job = NULL;
+	}
+	if (restore_job != NULL) {
+		delete_job(restore_job);
+		restore_job = NULL;
 	}
+	array_delete_vs_data(restored);
+	restored = NULL;
+	array_delete_vs_data(degraded_dirs);
+	degraded_dirs = NULL;
+	oldest_dir = newest_dir = NO_NODE;
+
+	settle_timer = NULL;  // freed with the loop
+	array_delete(settling);
+	settling = NULL;
+	churn_timer = dirty_timer = NULL;
+	array_delete_vs_data(coarse_dirs);
+	coarse_dirs = NULL;
+	array_delete(churned);
+	churned = NULL;
+
+	free(bulk_buf);
+	bulk_buf = NULL;
+	bulk_buf_len = 0;
+	free(alias_buf);
+	alias_buf = NULL;
+	alias_buf_len = 0;
+	free(inodes);
+	inodes = NULL;
+	inode_capacity = inode_count = 0;
+	alias_count = 0;
+	array_delete_vs_data(usages);
+	usages = NULL;
+
+	free(watches);
+	watches = NULL;
+	close_nodes();
 
 	if (inotify_fd >= 0) {
 		close(inotify_fd);
@@ -0,0 +1,364 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+
+/*
+ * Log ring: userlog() only copies the format pointer and its raw arguments (strings by value) into a slot of
+ * a bounded multi-producer ring, and a background thread formats them and passes them on to syslog.
+ * A full ring drops messages and counts them instead of blocking the caller. The thread sleeps on a condition
+ * variable while the ring is empty; producers only take its mutex when they find it asleep.
+ */
+#define LOG_RING_SIZE 1024  // a power of two
+#define LOG_MAX_ARGS 8
+#define LOG_TEXT_LEN 256    // room for copied string arguments
+#define LOG_LINE_LEN 1024
+
+enum {
+  ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF,
+  ARG_DOUBLE, ARG_LDOUBLE, ARG_PTR, ARG_STR, ARG_ERRNO
+};
+
+typedef union {
+  long long i;
+  intmax_t j;
+  long double d;
+  const void* p;
+  int offset;  // of a copied string in the slot text
+} log_arg;
+
+typedef struct {
+  atomic_size_t seq;
+  int priority;
+  const char* format;
+  int nargs;
+  log_arg args[LOG_MAX_ARGS];
+  char text[LOG_TEXT_LEN];
+} log_slot;
+
+// one conversion of a format: the kind of its argument and how many '*' values precede it
+typedef struct {
+  int kind;
+  int stars;
+} log_spec;
+
+static log_slot ring[LOG_RING_SIZE];
+static atomic_size_t head;
+static atomic_size_t tail;
+static atomic_ulong dropped;
+static atomic_bool stopping;
+static atomic_bool sleeping;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static unsigned long reported_drops = 0;
+static pthread_t drain_thread;
+static bool running = false;
+
+
+// parses the conversion starting after '%'; returns the character following it
+static const char* parse_spec(const char* p, log_spec* spec) {
+  spec->stars = 0;
+  while (*p != '\0' && strchr("-+ #0", *p) != NULL)  p++;
+  if (*p == '*') { spec->stars++; p++; }
+  while (*p >= '0' && *p <= '9')  p++;
+  if (*p == '.') {
+    p++;
+    if (*p == '*') { spec->stars++; p++; }
+    while (*p >= '0' && *p <= '9')  p++;
+  }
+
+  int length = ARG_INT;
+  if (p[0] == 'h') { p += (p[1] == 'h' ? 2 : 1); }
+  else if (p[0] == 'l' && p[1] == 'l') { length = ARG_LLONG; p += 2; }
+  else if (p[0] == 'l') { length = ARG_LONG; p++; }
+  else if (p[0] == 'q') { length = ARG_LLONG; p++; }
+  else if (p[0] == 'z') { length = ARG_SIZE; p++; }
+  else if (p[0] == 'j') { length = ARG_INTMAX; p++; }
+  else if (p[0] == 't') { length = ARG_PTRDIFF; p++; }
+  else if (p[0] == 'L') { length = ARG_LDOUBLE; p++; }
+
+  switch (*p) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+      spec->kind = (length == ARG_LDOUBLE ? ARG_LLONG : length);
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      spec->kind = (length == ARG_LDOUBLE ? ARG_LDOUBLE : ARG_DOUBLE);
+      break;
+    case 's':  spec->kind = ARG_STR; break;
+    case 'p':  spec->kind = ARG_PTR; break;
+    case 'm':  spec->kind = ARG_ERRNO; break;
+    case '\0':  spec->kind = ARG_NONE; return p;
+    default:  spec->kind = ARG_NONE; break;  // %%, and %n which is never honored
+  }
+  return p + 1;
+}
+
+
+static int copy_text(log_slot* slot, int* used, const char* s) {
+  int offset = *used;
+  if (s == NULL) {
+    s = "(null)";
+  }
+  size_t room = LOG_TEXT_LEN - offset;
+  if (room == 0) {
+    return LOG_TEXT_LEN - 1;  // the terminating zero of the last string
+  }
+  size_t len = strnlen(s, room - 1);
+  memcpy(slot->text + offset, s, len);
+  slot->text[offset + len] = '\0';
+  *used += len + 1;
+  return offset;
+}
+
+
+static void capture(log_slot* slot, const char* format, va_list ap) {
+  int errno_saved = errno;
+  int used = 0, n = 0;
+  log_spec spec;
+
+  for (const char* p = strchr(format, '%'); p != NULL && n < LOG_MAX_ARGS; p = strchr(p, '%')) {
+    p = parse_spec(p + 1, &spec);
+    for (int i = 0; i < spec.stars && n < LOG_MAX_ARGS; i++) {
+      slot->args[n++].i = va_arg(ap, int);
+    }
+    if (n == LOG_MAX_ARGS) {
+      break;
+    }
+    log_arg* arg = &slot->args[n];
+    switch (spec.kind) {
+      case ARG_NONE:  continue;
+      case ARG_INT:  arg->i = va_arg(ap, int); break;
+      case ARG_LONG:  arg->i = va_arg(ap, long); break;
+      case ARG_LLONG:  arg->i = va_arg(ap, long long); break;
+      case ARG_SIZE:  arg->i = (long long) va_arg(ap, size_t); break;
+      case ARG_INTMAX:  arg->j = va_arg(ap, intmax_t); break;
+      case ARG_PTRDIFF:  arg->i = va_arg(ap, ptrdiff_t); break;
+      case ARG_DOUBLE:  arg->d = va_arg(ap, double); break;
+      case ARG_LDOUBLE:  arg->d = va_arg(ap, long double); break;
+      case ARG_PTR:  arg->p = va_arg(ap, void*); break;
+      case ARG_STR:  arg->offset = copy_text(slot, &used, va_arg(ap, const char*)); break;
+      case ARG_ERRNO:  arg->offset = copy_text(slot, &used, strerror(errno_saved)); break;
+    }
+    n++;
+  }
+  slot->nargs = n;
+}
+
+
+// formats a captured message one conversion at a time
+static void format_slot(log_slot* slot, char* out, size_t size) {
+  const char* p = slot->format;
+  size_t len = 0;
+  int n = 0;
+  char piece[64];
+  log_spec spec;
+
+  while (*p != '\0' && len < size - 1) {
+    if (*p != '%') {
+      out[len++] = *p++;
+      continue;
+    }
+    const char* end = parse_spec(p + 1, &spec);
+    if (spec.kind == ARG_NONE || n + spec.stars >= slot->nargs || (size_t) (end - p) >= sizeof(piece)) {
+      if (p[1] == '%') {
+        out[len++] = '%';
+      }
+      p = (p[1] == '%' ? p + 2 : end);
+      continue;
+    }
+    memcpy(piece, p, end - p);
+    piece[end - p] = '\0';
+    if (spec.kind == ARG_ERRNO) {
+      strcpy(piece, "%s");
+    }
+
+    int w1 = (spec.stars > 0 ? (int) slot->args[n].i : 0), w2 = (spec.stars > 1 ? (int) slot->args[n + 1].i : 0);
+    log_arg* arg = &slot->args[n + spec.stars];
+    char* dst = out + len;
+    size_t room = size - len;
+    int written = 0;
+
+#define FORMAT_ARG(value) \
+    written = (spec.stars == 0 ? snprintf(dst, room, piece, value) : \
+               spec.stars == 1 ? snprintf(dst, room, piece, w1, value) : snprintf(dst, room, piece, w1, w2, value))
+
+    switch (spec.kind) {
+      case ARG_INT:  FORMAT_ARG((int) arg->i); break;
+      case ARG_LONG:  FORMAT_ARG((long) arg->i); break;
+      case ARG_LLONG:  FORMAT_ARG(arg->i); break;
+      case ARG_SIZE:  FORMAT_ARG((size_t) arg->i); break;
+      case ARG_INTMAX:  FORMAT_ARG(arg->j); break;
+      case ARG_PTRDIFF:  FORMAT_ARG((ptrdiff_t) arg->i); break;
+      case ARG_DOUBLE:  FORMAT_ARG((double) arg->d); break;
+      case ARG_LDOUBLE:  FORMAT_ARG(arg->d); break;
+      case ARG_PTR:  FORMAT_ARG(arg->p); break;
+      case ARG_STR: case ARG_ERRNO:  FORMAT_ARG(slot->text + arg->offset); break;
+    }
+#undef FORMAT_ARG
+
+    len += (written < 0 ? 0 : (size_t) written >= room ? room - 1 : (size_t) written);
+    n += spec.stars + 1;
+    p = end;
+  }
+  out[len] = '\0';
+}
+
+
+// pairs with the store of 'sleeping' in drain_loop: either the drainer sees the new slot or we see it asleep
+static void wake_drain() {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&sleeping, memory_order_relaxed)) {
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+  }
+}
+
+
+static bool ring_empty() {
+  size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+  size_t seq = atomic_load_explicit(&ring[pos & (LOG_RING_SIZE - 1)].seq, memory_order_acquire);
+  return (intptr_t) seq - (intptr_t) (pos + 1) < 0;
+}
+
+
+bool log_ring_put(int priority, const char* format, va_list ap) {
+  if (!running) {
+    return false;
+  }
+
+  size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+  log_slot* slot;
+  while (1) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if (diff < 0) {
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return true;
+    }
+    else {
+      pos = atomic_load_explicit(&head, memory_order_relaxed);
+    }
+  }
+
+  slot->priority = priority;
+  slot->format = format;
+  capture(slot, format, ap);
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  wake_drain();
+  return true;
+}
+
+
+static bool drain_ring() {
+  static char line[LOG_LINE_LEN];
+  bool any = false;
+
+  while (1) {
+    size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    log_slot* slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if ((intptr_t) seq - (intptr_t) (pos + 1) < 0) {
+      break;  // empty
+    }
+    // the only consumer; producers never move the tail
+    atomic_store_explicit(&tail, pos + 1, memory_order_relaxed);
+    format_slot(slot, line, sizeof(line));
+    int priority = slot->priority;
+    atomic_store_explicit(&slot->seq, pos + LOG_RING_SIZE, memory_order_release);
+
+    syslog(priority, "%s", line);
+    any = true;
+  }
+
+  unsigned long drops = atomic_load_explicit(&dropped, memory_order_relaxed);
+  if (drops != reported_drops) {
+    syslog(LOG_WARNING, "log ring overflow: %lu messages dropped", drops - reported_drops);
+    reported_drops = drops;
+  }
+  return any;
+}
+
+
+static void* drain_loop(void* data) {
+  while (!atomic_load(&stopping)) {
+    if (drain_ring()) {
+      continue;
+    }
+    pthread_mutex_lock(&wake_lock);
+    atomic_store(&sleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring_empty() && !atomic_load(&stopping)) {
+      pthread_cond_wait(&wake, &wake_lock);
+    }
+    atomic_store(&sleeping, false);
+    pthread_mutex_unlock(&wake_lock);
+  }
+  drain_ring();
+  return NULL;
+}
+
+
+bool start_log_ring() {
+  for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+    atomic_init(&ring[i].seq, i);
+  }
+  atomic_init(&head, 0);
+  atomic_init(&tail, 0);
+  atomic_init(&dropped, 0);
+  atomic_init(&stopping, false);
+  atomic_init(&sleeping, false);
+
+  if (pthread_create(&drain_thread, NULL, &drain_loop, NULL) != 0) {
+    return false;  // messages go to syslog directly
+  }
+  running = true;
+  return true;
+}
+
+
+// writes out everything queued so far; later messages go to syslog directly
+void stop_log_ring() {
+  if (running) {
+    running = false;
+    atomic_store(&stopping, true);
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_join(drain_thread, NULL);
+  }
+}
+
+
+unsigned long get_log_drops() {
+  return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
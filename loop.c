@@ -0,0 +1,315 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <time.h>
+
+
+#define EVENT_BUF_LEN 2048
+
+// timer wheel: WHEEL_SLOTS buckets of TICK_MS each; later timers wrap around and wait for their tick
+#define TICK_MS 10
+#define WHEEL_SLOTS 256
+
+typedef struct __source {
+  int fd;
+  short filter;  // EVFILT_READ for input, EVFILT_WRITE for writers
+  source_callback callback;
+  void* data;
+} source;
+
+struct __timer {
+  uint64_t expires;  // in ticks
+  uint64_t run;      // timers armed by a callback wait for the next run, so re-arming cannot starve the loop
+  timer_callback callback;
+  void* data;
+  struct __timer* next;
+  struct __timer** pprev;
+};
+
+static struct kevent event_buf[EVENT_BUF_LEN];
+static array* sources = NULL;
+static array* removed_sources = NULL;
+static timer* wheel[WHEEL_SLOTS];
+static int timer_count = 0;
+static uint64_t last_tick = 0;
+static uint64_t run_count = 0;
+static bool stopped = false;
+
+
+static uint64_t now_ticks() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+
+static bool add_source(int fd, short filter, source_callback callback, void* data) {
+  if (sources == NULL && (sources = array_create(10)) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+
+  source* s = malloc(sizeof(source));
+  if (s == NULL || array_push(sources, s) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    free(s);
+    return false;
+  }
+  s->fd = fd;
+  s->filter = filter;
+  s->callback = callback;
+  s->data = data;
+
+  struct kevent change;
+  EV_SET(&change, fd, filter, EV_ADD | EV_ENABLE, 0, 0, s);
+  if (kevent(get_inotify_fd(), &change, 1, NULL, 0, NULL) < 0) {
+    userlog(LOG_ERR, "kevent add source %d: %s", fd, strerror(errno));
+    array_pop(sources);
+    free(s);
+    return false;
+  }
+  return true;
+}
+
+
+bool loop_add_source(int fd, source_callback callback, void* data) {
+  return add_source(fd, EVFILT_READ, callback, data);
+}
+
+
+// the callback is called whenever fd can be written to, until the writer is removed
+bool loop_add_writer(int fd, source_callback callback, void* data) {
+  return add_source(fd, EVFILT_WRITE, callback, data);
+}
+
+
+// the source may still be referenced by the batch being dispatched, so it is only freed afterwards
+static void remove_source(int fd, short filter) {
+  for (int i=0; i<array_size(sources); i++) {
+    source* s = array_get(sources, i);
+    if (s->fd == fd && s->filter == filter) {
+      struct kevent change;
+      EV_SET(&change, fd, filter, EV_DELETE, 0, 0, NULL);
+      kevent(get_inotify_fd(), &change, 1, NULL, 0, NULL);
+
+      array_remove(sources, i);
+      s->fd = -1;
+      if (removed_sources == NULL) {
+        removed_sources = array_create(10);
+      }
+      if (array_push(removed_sources, s) == NULL) {
+        userlog(LOG_ERR, "out of memory");
+      }
+      return;
+    }
+  }
+}
+
+void loop_remove_source(int fd) {
+  remove_source(fd, EVFILT_READ);
+}
+
+void loop_remove_writer(int fd) {
+  remove_source(fd, EVFILT_WRITE);
+}
+
+
+timer* loop_add_timer(int delay_ms, timer_callback callback, void* data) {
+  timer* t = malloc(sizeof(timer));
+  if (t == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return NULL;
+  }
+  if (timer_count == 0) {
+    last_tick = now_ticks();
+  }
+
+  t->expires = now_ticks() + (delay_ms + TICK_MS - 1) / TICK_MS;
+  t->run = run_count;
+  t->callback = callback;
+  t->data = data;
+
+  timer** slot = &wheel[t->expires % WHEEL_SLOTS];
+  t->next = *slot;
+  t->pprev = slot;
+  if (*slot != NULL) {
+    (*slot)->pprev = &t->next;
+  }
+  *slot = t;
+  timer_count++;
+  return t;
+}
+
+
+static void unlink_timer(timer* t) {
+  *t->pprev = t->next;
+  if (t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  timer_count--;
+}
+
+
+void loop_cancel_timer(timer* t) {
+  if (t != NULL) {
+    unlink_timer(t);
+    free(t);
+  }
+}
+
+
+static void run_timers() {
+  uint64_t now = now_ticks();
+  uint64_t from = (now - last_tick >= WHEEL_SLOTS ? now - WHEEL_SLOTS + 1 : last_tick);
+  uint64_t run = ++run_count;
+
+  for (uint64_t tick = from; tick <= now && timer_count > 0; tick++) {
+    timer** slot = &wheel[tick % WHEEL_SLOTS];
+    timer* t = *slot;
+    while (t != NULL) {
+      if (t->expires > now || t->run == run) {
+        t = t->next;
+        continue;
+      }
+      // a callback may add or cancel timers in this very slot, so restart from its head
+      unlink_timer(t);
+      t->callback(t->data);
+      free(t);
+      t = *slot;
+    }
+  }
+  last_tick = now;
+}
+
+
+static struct timespec* next_timeout(struct timespec* ts) {
+  if (timer_count == 0) {
+    return NULL;
+  }
+
+  uint64_t now = now_ticks(), next = now + WHEEL_SLOTS;
+  for (uint64_t tick = now; tick < now + WHEEL_SLOTS; tick++) {
+    for (timer* t = wheel[tick % WHEEL_SLOTS]; t != NULL; t = t->next) {
+      if (t->expires < next) {
+        next = t->expires;
+      }
+    }
+    if (next <= tick) {
+      break;
+    }
+  }
+
+  uint64_t delay = (next > now ? (next - now) * TICK_MS : 0);
+  ts->tv_sec = delay / 1000;
+  ts->tv_nsec = (delay % 1000) * 1000000;
+  return ts;
+}
+
+
+// waits for kernel events, input and timers; everything that is ready gets handled on each wakeup
+void loop_run() {
+  bool go_on = true;
+
+  while (go_on && !stopped) {
+    struct timespec ts;
+    int len = kevent(get_inotify_fd(), NULL, 0, event_buf, EVENT_BUF_LEN, next_timeout(&ts));
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      userlog(LOG_ERR, "kevent: %s", strerror(errno));
+      break;
+    }
+
+    // kernel events go first: input handling may close and reuse descriptors they refer to
+    if (!process_inotify_events(event_buf, len)) {
+      break;
+    }
+
+    for (int i=0; i<len && go_on; i++) {
+      if (event_buf[i].filter == EVFILT_READ || event_buf[i].filter == EVFILT_WRITE) {
+        source* s = event_buf[i].udata;
+        if (s->fd >= 0) {
+          go_on = s->callback(s->data);
+        }
+      }
+    }
+
+    source* s;
+    while ((s = array_pop(removed_sources)) != NULL) {
+      free(s);
+    }
+
+    if (go_on && timer_count > 0) {
+      run_timers();
+    }
+  }
+}
+
+
+// handles the kernel events queued by now without waiting; input and timers are left to loop_run()
+bool loop_drain_events() {
+  static struct kevent drain_buf[EVENT_BUF_LEN];  // event_buf is still in use by the iteration calling this
+  struct timespec zero = { 0, 0 };
+  int len;
+  do {
+    len = kevent(get_inotify_fd(), NULL, 0, drain_buf, EVENT_BUF_LEN, &zero);
+    if (len < 0 && errno != EINTR) {
+      userlog(LOG_ERR, "kevent: %s", strerror(errno));
+      return false;
+    }
+    if (len > 0 && !process_inotify_events(drain_buf, len)) {
+      return false;
+    }
+  } while (len == EVENT_BUF_LEN || len < 0);
+  return true;
+}
+
+
+// makes loop_run() return after the current iteration; for callbacks that cannot return false
+void loop_stop() {
+  stopped = true;
+}
+
+
+void close_loop() {
+  source* s;
+  while ((s = array_pop(sources)) != NULL) {
+    free(s);
+  }
+  while ((s = array_pop(removed_sources)) != NULL) {
+    free(s);
+  }
+  array_delete(sources);
+  array_delete(removed_sources);
+  sources = removed_sources = NULL;
+
+  for (int i=0; i<WHEEL_SLOTS; i++) {
+    while (wheel[i] != NULL) {
+      loop_cancel_timer(wheel[i]);
+    }
+  }
+}
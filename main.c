@@ -15,18 +15,21 @@
 
 #include "fsnotifier.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/ucred.h>
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <unistd.h>
 
@@ -37,12 +40,39 @@
 #define LOG_ENV_ERROR "error"
 #define LOG_ENV_OFF "off"
 
+#define MEMORY_ENV "FSNOTIFIER_MEMORY_LIMIT"
+#define FINGERPRINT_ENV "FSNOTIFIER_FINGERPRINT_LIMIT"
+#define RECORD_ENV "FSNOTIFIER_RECORD"
+#define SHARDS_ENV "FSNOTIFIER_SHARDS"
+#define LAZY_ENV "FSNOTIFIER_LAZY_DEPTH"
+#define VCS_ENV "FSNOTIFIER_VCS"
+#define VCS_ENV_BATCH "batch"
+#define VCS_ENV_BULK "bulk"
+#define MAX_SHARDS 64
+
 #define USAGE_MSG \
     "fsnotifier - IntelliJ IDEA companion program for watching and reporting file and directory structure modifications.\n\n" \
     "fsnotifier utilizes \"user\" facility of syslog(3) - messages usually can be found in /var/log/user.log.\n" \
     "Verbosity is regulated via " LOG_ENV " environment variable, possible values are: " \
     LOG_ENV_DEBUG ", " LOG_ENV_INFO ", " LOG_ENV_WARNING ", " LOG_ENV_ERROR ", " LOG_ENV_OFF "; latter is the default.\n\n" \
-    "Use 'fsnotifier --selftest' to perform some self-diagnostics (output will be logged and printed to console).\n"
+    "Memory taken by the watch tree can be capped via " MEMORY_ENV " environment variable (in megabytes); " \
+    "above the cap least recently active directories are watched without their files until use drops well below it.\n\n" \
+    "Setting " FINGERPRINT_ENV " environment variable (in kilobytes) suppresses changes that leave a file as it was; " \
+    "files up to that size are compared by content, larger ones by size and modification time. " \
+    "A file is fingerprinted on its first write, so that write is always reported.\n\n" \
+    "Use 'fsnotifier --selftest' to perform some self-diagnostics (output will be logged and printed to console).\n\n" \
+    "Use 'fsnotifier --daemon <socket>' to serve several clients from one process over a local socket; " \
+    "'fsnotifier --connect <socket>' relays standard input and output to such a daemon.\n\n" \
+    "Setting " SHARDS_ENV " environment variable to a number above 1 spreads roots over that many worker processes, " \
+    "each with its own kernel queue; the process started by the client merges their output.\n\n" \
+    "Setting " LAZY_ENV " environment variable watches roots lazily: only directories, down to that many levels " \
+    "(0 for all), until the client sends EXPAND for a subtree it loads; COLLAPSE drops its files again.\n\n" \
+    "Setting " VCS_ENV " environment variable to '" VCS_ENV_BATCH "' holds events under a git work tree while " \
+    "git updates it, and sends them as one deduplicated batch when it is done; '" VCS_ENV_BULK "' also puts " \
+    "the batch between BULK and BULKEND messages.\n\n" \
+    "Setting " RECORD_ENV " environment variable to a file name records kernel events and directory listings there; " \
+    "'fsnotifier --replay <file> <dir>' replays such a recording against a copy of the tree simulated under dir, which must be new or empty, " \
+    "printing events to standard output and throughput and latency to standard error.\n"
 
 #define HELP_MSG \
     "Try 'fsnotifier --help' for more information.\n"
@@ -53,23 +83,92 @@ array* UNWATCHABLE = NULL;
 static bool show_warning = true;
 
 static bool self_test = false;
+static array* ready_order = NULL;  // roots in the order their crawls finished, self test only
 
 int level = LOG_EMERG;
 
 #define CHECK_NULL(p) if (p == NULL)  { userlog(LOG_ERR, "out of memory"); return false; }
 
+// a root watched on behalf of one or more sessions; unwatched when the last one lets it go
+typedef struct {
+  char* path;
+  int refs;
+  node_id node;  // holder of the root's tree; NO_NODE if the root is unwatchable
+  int mask;      // ROOT_* events; sessions asking for other events of the same path get a root of their own
+  bool ready;        // crawled completely
+} shared_root;
+
+struct __session {
+  FILE* in;
+  FILE* out;
+  int in_flags;      // of the input descriptor as found, restored on deletion
+  char* input;       // read but not handled yet; see session_input()
+  size_t input_len, input_capacity;
+  size_t input_pos;  // of the next line of the command being handled
+  out_queue* queue;  // everything sent to the client goes through it
+  event_ring* ring;  // events go here instead when the client asked for it
+  timer* ring_timer; // looks for room in a full ring
+  array* roots;
+  array* hot;  // paths the client is actively working with; see is_hot_path()
+  array* expanded;  // directories the client sent EXPAND for, as watched; see update_expanded()
+  array* dirty;  // directories held back while the queue is congested or the ring full, reported as RECDIRTY later
+  array* reset;  // roots held back the same way when too many directories pile up, reported as RESET
+  bool paused;   // input is not read while the queue is congested
+  unsigned long coalesced;
+  unsigned long seq;  // number of the last event record sent, see answer_sync()
+  bool numbered;      // event records carry their number
+  bool attributed;    // records of changed and created paths carry their attributes, see send_event()
+};
+
+static array* shared_roots = NULL;
+static array* sessions = NULL;
+static session* current = NULL;
+static int hot_count = 0;
+static bool daemon_mode = false;
+static int shard = SHARD_NONE;
+
 static void init_log();
+static void init_memory_limit();
+static void init_fingerprint_limit();
+static void init_record();
+static void init_vcs_batching();
+static void init_lazy_depth();
+static int get_shard_count();
 static void run_self_test();
 static void main_loop();
-static bool read_input();
+static bool read_input(session* s);
+static char* next_line(session* s);
+static bool session_input(void* data);
+static array* read_paths(session* s);
+static bool update_hot_paths(array* hot_paths);
+static void report_status(session* s);
+static bool answer_query(session* s, const char* command);
+static bool is_under(const char* root, const char* path);
+static bool end_session(session* s);
 static bool update_roots(array* new_roots);
 static void unregister_roots();
 static bool register_roots(array* new_roots, array* unwatchable);
+static void release_roots(array* roots);
 static bool unwatchable_mounts(array* mounts);
+static const char* roots_reply();
+static bool report_unwatchable(session* s, const char* type);
+static void root_crawled(void* data, int result);
+static void session_drained(void* data);
+static bool open_ring(session* s);
+static bool answer_estimate(session* s);
+static bool answer_sync(session* s);
+static bool update_expanded(session* s, bool expanded);
+static void collapse_expanded(session* s);
+static bool covered(array* paths, const char* path);
 static void inotify_callback(char* path, int event);
 
 
 int main(int argc, char** argv) {
+  const char* daemon_socket = NULL;
+  const char* client_socket = NULL;
+  const char* replay_file = NULL;
+  const char* replay_dir = NULL;
+
   if (argc > 1) {
     if (strcmp(argv[1], "--help") == 0) {
       printf(USAGE_MSG);
@@ -78,6 +177,16 @@ int main(int argc, char** argv) {
     else if (strcmp(argv[1], "--selftest") == 0) {
       self_test = true;
     }
+    else if (strcmp(argv[1], "--daemon") == 0 && argc > 2) {
+      daemon_socket = argv[2];
+    }
+    else if (strcmp(argv[1], "--connect") == 0 && argc > 2) {
+      client_socket = argv[2];
+    }
+    else if (strcmp(argv[1], "--replay") == 0 && argc > 3) {
+      replay_file = argv[2];
+      replay_dir = argv[3];
+    }
     else {
       printf("unrecognized option: %s\n", argv[1]);
       printf(HELP_MSG);
@@ -85,7 +194,25 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (daemon_socket == NULL && client_socket == NULL && replay_file == NULL && !self_test && get_shard_count() > 1) {
+    shard = start_shards(get_shard_count());  // before the log thread is started
+  }
+
   init_log();
+  if (shard == SHARD_FRONT) {
+    int rv = run_front();
+    userlog(LOG_INFO, "finished");
+    stop_log_ring();
+    closelog();
+    return rv;
+  }
+  if (client_socket != NULL) {
+    int rv = run_client(client_socket);
+    stop_log_ring();
+    closelog();
+    return rv;
+  }
+
   if (!self_test) {
     userlog(LOG_INFO, "started");
   }
@@ -97,25 +224,60 @@ int main(int argc, char** argv) {
   setvbuf(stdout, NULL, _IONBF, 0);
 
   ROOTS = array_create(20);
-  if (init_inotify() && ROOTS != NULL) {
+  shared_roots = array_create(20);
+  sessions = array_create(5);
+  if (init_inotify() && ROOTS != NULL && shared_roots != NULL && sessions != NULL) {
     set_inotify_callback(&inotify_callback);
+    init_memory_limit();
+    init_fingerprint_limit();
+    init_vcs_batching();
+    init_lazy_depth();
+    if (replay_file == NULL) {
+      init_record();
+    }
 
-    if (!self_test) {
-      main_loop();
+    if (replay_file != NULL) {
+      if (start_replay(replay_file, replay_dir)) {
+        main_loop();
+      }
     }
-    else {
-      run_self_test();
+    else if (daemon_socket != NULL) {
+      daemon_mode = true;
+      if (init_daemon(daemon_socket)) {
+        main_loop();
+      }
+      close_daemon();
+    }
+    else if ((current = session_create(stdin, stdout)) != NULL) {
+      if (!self_test) {
+        main_loop();
+      }
+      else {
+        run_self_test();
+      }
     }
 
+    session* s;
+    while ((s = array_get(sessions, 0)) != NULL) {
+      session_delete(s);
+    }
     unregister_roots();
   }
   else {
     printf("GIVEUP\n");
   }
+  close_vcs();
+  close_loop();
   close_inotify();
+  close_fingerprints();
+  close_recording();
+  close_replay();
+  array_delete(sessions);
+  array_delete(shared_roots);
   array_delete(ROOTS);
 
   userlog(LOG_INFO, "finished");
+  stop_log_ring();
   closelog();
 
   return 0;
@@ -139,14 +301,109 @@ static void init_log() {
   snprintf(ident, sizeof(ident), "fsnotifier[%d]", getpid());
   openlog(ident, 0, LOG_USER);
   setlogmask(LOG_UPTO(level));
+
+  if (!self_test && level > LOG_EMERG) {
+    start_log_ring();
+  }
+}
+
+
+static void init_memory_limit() {
+  char* env_limit = getenv(MEMORY_ENV);
+  if (env_limit != NULL) {
+    long mb = strtol(env_limit, NULL, 10);
+    if (mb > 0) {
+      set_memory_limit((size_t) mb * 1024 * 1024);
+      userlog(LOG_INFO, "memory limit: %ld MB", mb);
+    }
+    else {
+      userlog(LOG_WARNING, "invalid %s: %s", MEMORY_ENV, env_limit);
+    }
+  }
+}
+
+
+static void init_fingerprint_limit() {
+  char* env_limit = getenv(FINGERPRINT_ENV);
+  if (env_limit != NULL) {
+    char* end;
+    long kb = strtol(env_limit, &end, 10);
+    if (kb >= 0 && end != env_limit && *end == '\0') {
+      if (init_fingerprints((size_t) kb * 1024)) {
+        userlog(LOG_INFO, "change suppression: hashing files up to %ld KB", kb);
+      }
+    }
+    else {
+      userlog(LOG_WARNING, "invalid %s: %s", FINGERPRINT_ENV, env_limit);
+    }
+  }
+}
+
+
+static void init_record() {
+  char* env_file = getenv(RECORD_ENV);
+  char file[PATH_MAX];
+  if (env_file == NULL) {
+    return;
+  }
+  if (shard >= 0) {
+    snprintf(file, sizeof(file), "%s.%d", env_file, shard);  // one recording per shard
+    env_file = file;
+  }
+  if (init_recording(env_file)) {
+    userlog(LOG_INFO, "recording to %s", env_file);
+  }
+}
+
+
+static void init_vcs_batching() {
+  char* env_vcs = getenv(VCS_ENV);
+  if (env_vcs == NULL) {
+    return;
+  }
+  if (strcmp(env_vcs, VCS_ENV_BATCH) != 0 && strcmp(env_vcs, VCS_ENV_BULK) != 0) {
+    userlog(LOG_WARNING, "invalid %s: %s", VCS_ENV, env_vcs);
+  }
+  else if (init_vcs(strcmp(env_vcs, VCS_ENV_BULK) == 0)) {
+    userlog(LOG_INFO, "vcs batching: %s", env_vcs);
+  }
+}
+
+
+static void init_lazy_depth() {
+  char* env_depth = getenv(LAZY_ENV);
+  if (env_depth != NULL) {
+    char* end;
+    long depth = strtol(env_depth, &end, 10);
+    if (depth >= 0 && depth <= INT_MAX && end != env_depth && *end == '\0') {
+      set_lazy_depth((int) depth);
+      userlog(LOG_INFO, "lazy watching, directory depth %ld", depth);
+    }
+    else {
+      userlog(LOG_WARNING, "invalid %s: %s", LAZY_ENV, env_depth);
+    }
+  }
+}
+
+
+static int get_shard_count() {
+  char* env_count = getenv(SHARDS_ENV);
+  long count = (env_count != NULL ? strtol(env_count, NULL, 10) : 1);
+  return (count > 1 ? (count < MAX_SHARDS ? (int) count : MAX_SHARDS) : 1);
 }
 
 
 void userlog(int priority, const char* format, ...) {
   va_list ap;
 
+  if (priority > level) {
+    return;  // masked out by syslog anyway
+  }
+
   va_start(ap, format);
-  vsyslog(priority, format, ap);
+  if (!log_ring_put(priority, format, ap)) {
+    vsyslog(priority, format, ap);
+  }
   va_end(ap);
 
   if (self_test) {
@@ -167,152 +424,972 @@ void userlog(int priority, const char* format, ...) {
 }
 
 
+// READY must follow ROOTS order; subdirectories of the current one are watched as separate roots to check it
+static void check_ready_order(const char* cwd) {
+  array* test_roots = array_create(4);
+  DIR* dir = opendir(cwd);
+  struct dirent* entry;
+  while (dir != NULL && array_size(test_roots) < 4 && (entry = readdir(dir)) != NULL) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (entry->d_name[0] != '.' && snprintf(path, PATH_MAX, "%s/%s", cwd, entry->d_name) < PATH_MAX &&
+        stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      array_push(test_roots, strdup(path));
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  if (array_size(test_roots) < 3 || (ready_order = array_create(4)) == NULL) {
+    userlog(LOG_INFO, "READY order not checked: fewer than 3 subdirectories");
+    array_delete_vs_data(test_roots);
+    return;
+  }
+
+  update_roots(test_roots);
+  finish_crawls();
+  int ready = 0;
+  bool ordered = true;
+  for (int i=0; i<array_size(current->roots); i++) {
+    shared_root* root = array_get(current->roots, i);
+    if (root->ready && array_get(ready_order, ready++) != root) {
+      ordered = false;
+    }
+  }
+  if (ordered && ready == array_size(ready_order)) {
+    userlog(LOG_INFO, "READY order of %d roots follows ROOTS", ready);
+  }
+  else {
+    userlog(LOG_ERR, "READY order of %d roots differs from ROOTS", array_size(ready_order));
+  }
+  array_delete(ready_order);
+  ready_order = NULL;
+}
+
+
 static void run_self_test() {
   array* test_roots = array_create(1);
   char* cwd = malloc(PATH_MAX);
   if (getcwd(cwd, PATH_MAX) == NULL) {
     strncpy(cwd, ".", PATH_MAX);
   }
+  check_ready_order(cwd);
   array_push(test_roots, cwd);
   update_roots(test_roots);
+  finish_crawls();
 }
 
 
-static void main_loop() {
-  int input_fd = fileno(stdin), inotify_fd = get_inotify_fd();
-  int nfds = (inotify_fd > input_fd ? inotify_fd : input_fd) + 1;
-  fd_set rfds;
-  bool go_on = true;
+/*
+ * Input is read as it arrives, without blocking, and a command is handled only once it is buffered whole,
+ * list of paths and all; a client stopping in the middle of one holds up nobody but itself.
+ */
+#define INPUT_CHUNK 4096
 
-  while (go_on) {
-    FD_ZERO(&rfds);
-    FD_SET(input_fd, &rfds);
-    FD_SET(inotify_fd, &rfds);
-    if (select(nfds, &rfds, NULL, NULL, NULL) < 0) {
-      userlog(LOG_ERR, "select: %s", strerror(errno));
-      go_on = false;
-    }
-    else if (FD_ISSET(input_fd, &rfds)) {
-      go_on = read_input();
+// whether the input starts with a whole command, see command_length()
+static bool command_buffered(session* s) {
+  s->input_pos = command_length(s->input, s->input_len);  // where the command ends, for now
+  return s->input_pos > 0;
+}
+
+// the next line of the buffered command, trimmed; valid until the command is handled
+static char* next_line(session* s) {
+  char* line = s->input + s->input_pos;
+  char* nl = memchr(line, '\n', s->input_len - s->input_pos);
+  if (nl == NULL) {
+    return NULL;
+  }
+  *nl = '\0';
+  if (nl > line && nl[-1] == '\r')  nl[-1] = '\0';
+  s->input_pos = nl + 1 - s->input;
+  return line;
+}
+
+static bool fill_input(session* s, bool* eof) {
+  if (s->input_capacity - s->input_len < INPUT_CHUNK) {
+    size_t capacity = (s->input_capacity > 0 ? s->input_capacity * 2 : INPUT_CHUNK * 2);
+    char* input = (capacity <= INPUT_LIMIT ? realloc(s->input, capacity) : NULL);
+    if (input == NULL) {
+      userlog(LOG_WARNING, "input of %d too long or out of memory", fileno(s->in));
+      return false;
     }
-    else if (FD_ISSET(inotify_fd, &rfds)) {
-      go_on = process_inotify_input();
+    s->input = input;
+    s->input_capacity = capacity;
+  }
+
+  ssize_t n = read(fileno(s->in), s->input + s->input_len, s->input_capacity - s->input_len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  }
+  *eof = (n <= 0);
+  if (n > 0) {
+    s->input_len += n;
+  }
+  return true;
+}
+
+// a client that does not read its output does not get its requests read either
+static bool session_input(void* data) {
+  session* s = data;
+  bool eof = false;
+  if (!fill_input(s, &eof)) {
+    return end_session(s);
+  }
+
+  while (command_buffered(s)) {
+    size_t command_len = s->input_pos;
+    s->input_pos = 0;
+    bool ok = read_input(s);
+    memmove(s->input, s->input + command_len, s->input_len - command_len);
+    s->input_len -= command_len;
+    if (!ok) {
+      return end_session(s);
     }
   }
+  if (eof) {
+    userlog(LOG_DEBUG, "input: <null>");
+    return end_session(s);
+  }
+
+  if (queue_congested(s->queue) && !s->paused) {
+    loop_remove_source(fileno(s->in));
+    s->paused = true;
+  }
+  return true;
 }
 
 
-static bool read_input() {
-  char* line = read_line(stdin);
-  userlog(LOG_DEBUG, "input: %s", (line ? line : "<null>"));
+static bool daemon_input(void* data) {
+  return accept_client();
+}
+
+
+static void main_loop() {
+  if (get_daemon_fd() >= 0 && !loop_add_source(get_daemon_fd(), &daemon_input, NULL)) {
+    return;
+  }
+  loop_run();
+}
 
-  if (line == NULL || strcmp(line, "EXIT") == 0) {
+
+static bool read_input(session* s) {
+  current = s;
+  char* line = next_line(s);
+  userlog(LOG_DEBUG, "input: %s", line);
+
+  if (strcmp(line, "EXIT") == 0) {
     return false;
   }
 
   if (strcmp(line, "ROOTS") == 0) {
-    array* new_roots = array_create(20);
-    CHECK_NULL(new_roots);
+    array* new_roots = read_paths(s);
+    if (new_roots != NULL) {
+      record_roots(new_roots);
+    }
+    return new_roots != NULL && update_roots(new_roots);
+  }
+  else if (strcmp(line, "HOT") == 0) {
+    array* hot_paths = read_paths(s);
+    return hot_paths != NULL && update_hot_paths(hot_paths);
+  }
+  else if (strcmp(line, "STATUS") == 0) {
+    report_status(s);
+  }
+  else if (strcmp(line, "RING") == 0) {
+    return open_ring(s);
+  }
+  else if (strcmp(line, "ESTIMATE") == 0) {
+    return answer_estimate(s);
+  }
+  else if (strcmp(line, "SYNC") == 0) {
+    return answer_sync(s);
+  }
+  else if (strcmp(line, "EXPAND") == 0 || strcmp(line, "COLLAPSE") == 0) {
+    return update_expanded(s, strcmp(line, "EXPAND") == 0);
+  }
+  else if (strcmp(line, "SEQUENCE") == 0) {
+    s->numbered = true;
+  }
+  else if (strcmp(line, "ATTRIBUTES") == 0) {
+    s->attributed = true;
+    output("ATTRIBUTES\n");  // records sent before it come without attributes
+  }
+  else if (strcmp(line, "EXISTS") == 0 || strcmp(line, "LIST") == 0 || strcmp(line, "LIST STAT") == 0 ||
+           strcmp(line, "SUBTREE") == 0 || strcmp(line, "SUBTREE STAT") == 0) {
+    return answer_query(s, line);
+  }
 
-    while (1) {
-      line = read_line(stdin);
-      userlog(LOG_DEBUG, "input: %s", (line ? line : "<null>"));
-      if (line == NULL || strlen(line) == 0) {
-        return false;
-      }
-      else if (strcmp(line, "#") == 0) {
-        break;
-      }
-      else {
-        if (line[0] == '|')  line++;  // flat roots will be differentiated later
+  return true;
+}
+
+
+// reads a '#'-terminated list of paths; returns NULL when input ends prematurely
+static array* read_paths(session* s) {
+  array* paths = array_create(20);
+  if (paths == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return NULL;
+  }
+
+  while (1) {
+    char* line = next_line(s);
+    userlog(LOG_DEBUG, "input: %s", (line ? line : "<null>"));
+    if (line == NULL || strlen(line) == 0) {
+      array_delete_vs_data(paths);
+      return NULL;
+    }
+    else if (strcmp(line, "#") == 0) {
+      break;
+    }
+    else {
+      if (line[0] == '|')  line++;  // flat roots will be differentiated later
 
-        int l = strlen(line);
-        if (l > 1 && line[l-1] == '/')  line[l-1] = '\0';
+      int l = strlen(line);
+      if (l > 1 && line[l-1] == '/')  line[l-1] = '\0';
 
-        CHECK_NULL(array_push(new_roots, strdup(line)));
+      char* path = strdup(line);
+      if (path == NULL || array_push(paths, path) == NULL) {
+        userlog(LOG_ERR, "out of memory");
+        free(path);
+        array_delete_vs_data(paths);
+        return NULL;
       }
     }
+  }
+
+  return paths;
+}
 
-    return update_roots(new_roots);
 
+// in daemon mode a finished client only takes its own roots along; the daemon goes away with the last one
+static bool end_session(session* s) {
+  if (!daemon_mode) {
+    return false;
   }
+  userlog(LOG_INFO, "client disconnected: %d", fileno(s->in));
+  session_delete(s);
+  return array_size(sessions) > 0;
+}
 
-  return true;
+
+// takes the streams over; they are closed along with the session, or right away if it cannot be created
+session* session_create(FILE* in, FILE* out) {
+  session* s = calloc(1, sizeof(session));
+  if (s == NULL || (s->roots = array_create(20)) == NULL || (s->dirty = array_create(20)) == NULL ||
+      (s->reset = array_create(5)) == NULL || (s->expanded = array_create(5)) == NULL || array_push(sessions, s) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    if (s != NULL) {
+      array_delete(s->roots);
+      array_delete(s->dirty);
+      array_delete(s->reset);
+      array_delete(s->expanded);
+      free(s);
+    }
+    if (in != stdin)  fclose(in);
+    if (out != stdout)  fclose(out);
+    return NULL;
+  }
+  s->in = in;
+  s->out = out;
+
+  s->in_flags = fcntl(fileno(in), F_GETFL);
+  if (s->in_flags < 0 || fcntl(fileno(in), F_SETFL, s->in_flags | O_NONBLOCK) < 0) {
+    userlog(LOG_WARNING, "fcntl(%d): %s", fileno(in), strerror(errno));
+  }
+
+  if ((s->queue = queue_create(fileno(out), &session_drained, s)) == NULL) {
+    session_delete(s);
+    return NULL;
+  }
+
+  if (!loop_add_source(fileno(in), &session_input, s)) {
+    session_delete(s);
+    return NULL;
+  }
+  return s;
+}
+
+
+void session_delete(session* s) {
+  for (int i=0; i<array_size(sessions); i++) {
+    if (array_get(sessions, i) == s) {
+      array_remove(sessions, i);
+      break;
+    }
+  }
+  if (current == s) {
+    current = NULL;
+  }
+  loop_remove_source(fileno(s->in));
+  cancel_estimates(s);
+
+  collapse_expanded(s);
+  array_delete(s->expanded);
+  release_roots(s->roots);
+  array_delete(s->roots);
+  hot_count -= array_size(s->hot);
+  array_delete_vs_data(s->hot);
+  array_delete_vs_data(s->dirty);
+  array_delete_vs_data(s->reset);
+  loop_cancel_timer(s->ring_timer);
+  ring_delete(s->ring);
+  queue_delete(s->queue, s->out == stdout);  // a socket client gets what it takes right away
+  if (s->in_flags >= 0) {
+    fcntl(fileno(s->in), F_SETFL, s->in_flags);
+  }
+  free(s->input);
+  if (s->in != stdin) {
+    fclose(s->in);
+  }
+  if (s->out != stdout) {
+    fclose(s->out);
+  }
+  free(s);
 }
 
 
 static bool update_roots(array* new_roots) {
-  userlog(LOG_INFO, "updating roots (curr:%d, new:%d)", array_size(ROOTS), array_size(new_roots));
+  userlog(LOG_INFO, "updating roots (curr:%d, new:%d)", array_size(current->roots), array_size(new_roots));
+
+  // new roots are retained before the old ones are released, so roots present in both are not re-crawled
+  array* old_roots = current->roots;
+  current->roots = array_create(20);
+  if (current->roots == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    current->roots = old_roots;
+    array_delete_vs_data(new_roots);
+    return false;
+  }
+
+  // on failure the session goes away, releasing what was registered of the new roots
+  bool ok = true;
+  int mask;
+  if (array_size(new_roots) == 1 && strcmp(parse_root(array_get(new_roots, 0), &mask), "/") == 0) {  // refuse to watch entire tree
+    output("%s\n/\n#\n", roots_reply());
+    userlog(LOG_INFO, "unwatchable: /");
+  }
+  else if (array_size(new_roots) > 0) {
+    UNWATCHABLE = array_create(20);
+    if (UNWATCHABLE == NULL) {
+      userlog(LOG_ERR, "out of memory");
+      ok = false;
+    }
+    ok = ok && unwatchable_mounts(UNWATCHABLE) && register_roots(new_roots, UNWATCHABLE);
+    array_delete_vs_data(UNWATCHABLE);
+    UNWATCHABLE = NULL;
+
+    // roots are acknowledged right away; the crawl goes on in the background and each root reports READY
+    ok = ok && report_unwatchable(current, roots_reply());
+    for (int i=0; i<array_size(current->roots) && ok; i++) {
+      shared_root* root = array_get(current->roots, i);
+      if (root->ready) {
+        output("READY\n%s\n", root->path);
+      }
+    }
+  }
+
+  release_roots(old_roots);
+  array_delete(old_roots);
+  array_delete_vs_data(new_roots);
+  return ok;
+}
 
-  unregister_roots();
-  if (array_size(new_roots) == 0) {
+
+// memory figures are in bytes; 'root' lines cover the roots of the session only
+static void report_status(session* s) {
+  output("STATUS\n");
+  output("watches %d\n", get_node_count());
+  output("memory %zu\n", get_memory_used());
+  output("memory-limit %zu\n", get_memory_limit());
+  output("memory-table %zu\n", get_table_memory());
+  output("log-dropped %lu\n", get_log_drops());
+  output("aliases %d\n", get_alias_count());
+  output("queued %zu\n", queue_length(s->queue));
+  output("coalesced %lu\n", s->coalesced);
+  output("vcs-held %zu\n", get_vcs_held());
+  if (s->ring != NULL) {
+    output("ring-used %zu\n", ring_used(s->ring));
+  }
+  if (fingerprints_enabled()) {
+    unsigned long suppressed, passed;
+    get_fingerprint_counters(&suppressed, &passed);
+    output("suppressed %lu\n", suppressed);
+    output("not-suppressed %lu\n", passed);
+  }
+  for (int i=0; i<array_size(s->roots); i++) {
+    shared_root* root = array_get(s->roots, i);
+    if (root->node != NO_NODE) {
+      output("root %zu %s\n", get_root_memory(root->node), root->path);
+    }
+  }
+  output("#\n");
+}
+
+
+/*
+ * Tree queries are answered from the watch tree instead of the disk. A path the tree cannot vouch for
+ * (outside the session roots, root not crawled yet, files of a degraded directory, contents of a directory
+ * the crawl skipped) is answered with UNKNOWN. SUBTREE walks in name order and resumes after the path
+ * a previous page ended with, so pages neither skip nor repeat entries while the tree changes.
+ */
+#define SUBTREE_PAGE 1000
+
+// directories whose entries the tree does not hold
+#define UNLISTED (NODE_DIRONLY | NODE_COARSE | NODE_LAZY | NODE_SKIPPED)
+
+static node_id query_root(session* s, const char* path) {
+  for (int i=0; i<array_size(s->roots); i++) {
+    shared_root* root = array_get(s->roots, i);
+    if (root->node != NO_NODE && root->ready && is_under(root->path, path)) {
+      return root->node;
+    }
+  }
+  return NO_NODE;
+}
+
+static void output_entry(node_id node, bool stats, bool full_path) {
+  const char* name = node_name(node);
+  char type = (node_isdir(node) ? 'd' : 'f');
+  if (!full_path && strrchr(name, '/') != NULL) {
+    name = strrchr(name, '/') + 1;
+  }
+
+  struct stat st;
+  if (!stats) {
+    output("%c %s\n", type, name);
+  }
+  else if ((node_wd(node) >= 0 ? fstat(node_wd(node), &st) : stat(node_name(node), &st)) == 0) {
+    output("%c %llu %lld %lld.%09ld %s\n", type, (unsigned long long) st.st_ino,
+           (long long) st.st_size, (long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec, name);
+  }
+  else {
+    output("%c - - - %s\n", type, name);
+  }
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(node_name(*(const node_id*) a), node_name(*(const node_id*) b));
+}
+
+// pre-order walk from the entry following the path after (NULL for the start); stops when *budget runs out
+static void output_subtree(node_id node, bool stats, const char* after, int* budget, const char** last) {
+  int count = 0;
+  node_id* kids = malloc(sizeof(node_id) * (node_kid_count(node) + 1));
+  if (kids == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    *budget = 0;
+    return;
+  }
+  for (int i=0; i<node_kid_count(node); i++) {
+    if (node_kid(node, i) != NO_NODE) {
+      kids[count++] = node_kid(node, i);
+    }
+  }
+  qsort(kids, count, sizeof(node_id), &compare_names);
+
+  size_t component = 0;  // of after, at this level
+  if (after != NULL) {
+    const char* slash = strchr(after + strlen(node_name(node)) + 1, '/');
+    component = (slash != NULL ? (size_t) (slash - after) : strlen(after));
+  }
+  for (int i=0; i<count && *budget > 0; i++) {
+    const char* name = node_name(kids[i]);
+    if (after != NULL) {
+      int cmp = strncmp(name, after, component);
+      if (cmp == 0 && name[component] == '\0') {  // leads to after, or is it: its entries follow
+        output_subtree(kids[i], stats, (after[component] != '\0' ? after : NULL), budget, last);
+        after = NULL;
+        continue;
+      }
+      if (cmp < 0) {
+        continue;
+      }
+      after = NULL;
+    }
+    output_entry(kids[i], stats, true);
+    (*budget)--;
+    *last = name;
+    output_subtree(kids[i], stats, NULL, budget, last);
+  }
+  free(kids);
+}
+
+static bool answer_query(session* s, const char* command) {
+  char cmd[16];
+  strncpy(cmd, command, sizeof(cmd) - 1);
+  cmd[sizeof(cmd) - 1] = '\0';
+  bool stats = (strstr(cmd, " STAT") != NULL);
+
+  char* line = next_line(s);
+  if (line == NULL) {
+    return false;
+  }
+  char buf[PATH_MAX], path[PATH_MAX];
+  strncpy(path, (realpath(line, buf) != NULL ? buf : line), PATH_MAX - 1);
+  path[PATH_MAX - 1] = '\0';
+  int l = strlen(path);
+  if (l > 1 && path[l-1] == '/')  path[l-1] = '\0';
+
+  char cursor[PATH_MAX] = "";  // the last path of the previous page; anything not under path starts over
+  int limit = SUBTREE_PAGE;
+  if (strncmp(cmd, "SUBTREE", 7) == 0) {
+    if ((line = next_line(s)) == NULL)  return false;
+    strncpy(cursor, line, PATH_MAX - 1);
+    cursor[PATH_MAX - 1] = '\0';
+    if ((line = next_line(s)) == NULL)  return false;
+    limit = atoi(line);
+    if (limit <= 0)  limit = SUBTREE_PAGE;
+  }
+  userlog(LOG_DEBUG, "query: %s %s", cmd, path);
+
+  node_id holder = query_root(s, path);
+  node_id node = (holder != NO_NODE ? find_node(holder, path) : NO_NODE);
+
+  if (strcmp(cmd, "EXISTS") == 0) {
+    const char* answer = "unknown";
+    if (node != NO_NODE) {
+      answer = "yes";
+    }
+    else if (holder != NO_NODE && strrchr(path, '/') != NULL) {
+      *strrchr(path, '/') = '\0';
+      node_id parent = find_node(holder, path);
+      *(path + strlen(path)) = '/';
+      if (parent != NO_NODE && node_isdir(parent) && !(nodes.flags[parent] & UNLISTED)) {
+        answer = "no";
+      }
+    }
+    output("EXISTS\n%s\n%s\n", path, answer);
     return true;
   }
-  else if (array_size(new_roots) == 1 && strcmp(array_get(new_roots, 0), "/") == 0) {  // refuse to watch entire tree
-    output("UNWATCHEABLE\n/\n#\n");
-    userlog(LOG_INFO, "unwatchable: /");
-    array_delete_vs_data(new_roots);
+
+  if (node == NO_NODE || !node_isdir(node) || (nodes.flags[node] & UNLISTED)) {
+    output("UNKNOWN\n%s\n", path);
     return true;
   }
 
-  UNWATCHABLE = array_create(20);
-  CHECK_NULL(UNWATCHABLE);
-  if (!unwatchable_mounts(UNWATCHABLE)) {
+  if (strncmp(cmd, "LIST", 4) == 0) {
+    output("LIST\n%s\n", path);
+    for (int i=0; i<node_kid_count(node); i++) {
+      node_id kid = node_kid(node, i);
+      if (kid != NO_NODE) {
+        output_entry(kid, stats, false);
+      }
+    }
+    output("#\n");
+  }
+  else {
+    int budget = limit;
+    const char* last = NULL;
+    bool resumed = (strcmp(cursor, path) != 0 && is_under(path, cursor));
+    output("SUBTREE\n%s\n", path);
+    output_subtree(node, stats, (resumed ? cursor : NULL), &budget, &last);
+    output("#\n%s\n", (budget == 0 && last != NULL ? last : "-1"));  // next cursor, -1 once complete
+  }
+  return true;
+}
+
+
+/*
+ * ESTIMATE <root>: what adding the root (a ROOTS line) would take, without watching anything; see estimate_tree().
+ * fd-limit is the most descriptors the process may hold, to be compared with fds and the watches of STATUS.
+ * The tree is walked in crawl slices, and the reply comes when the walk is done; commands sent meanwhile
+ * may be answered before it.
+ */
+static void estimated(void* data, const char* path, const tree_estimate* e) {
+  session* prev = current;
+  current = data;
+  if (e == NULL) {
+    output("UNKNOWN\n%s\n", path);
+    current = prev;
+    return;
+  }
+
+  unsigned long fd_limit = get_watch_count();
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < fd_limit) {
+    fd_limit = rl.rlim_cur;
+  }
+
+  output("ESTIMATE\n%s\n", path);
+  output("watches %lu\n", e->dirs + e->files);
+  output("directories %lu\n", e->dirs);
+  output("files %lu\n", e->files);
+  output("fds %lu\n", e->fds);
+  output("fd-limit %lu\n", fd_limit);
+  output("memory %zu\n", e->memory);
+  output("memory-limit %zu\n", get_memory_limit());
+  output("crawl-ms %lu\n", e->crawl_ms);
+  output("sampled %s\n", e->sampled ? "yes" : "no");
+  output("complete %s\n", e->complete ? "yes" : "no");
+  output("#\n");
+  current = prev;
+}
+
+static bool answer_estimate(session* s) {
+  char* line = next_line(s);
+  if (line == NULL) {
+    return false;
+  }
+  if (line[0] == '|')  line++;
+
+  int mask;
+  char buf[PATH_MAX], path[PATH_MAX];
+  const char* root = parse_root(line, &mask);
+  strncpy(path, (realpath(root, buf) != NULL ? buf : root), PATH_MAX - 1);
+  path[PATH_MAX - 1] = '\0';
+  int l = strlen(path);
+  if (l > 1 && path[l-1] == '/')  path[l-1] = '\0';
+
+  array* mounts = array_create(20);
+  CHECK_NULL(mounts);
+  if (!unwatchable_mounts(mounts)) {
+    array_delete_vs_data(mounts);
     return false;
   }
+  return estimate_tree(path, (mask & ROOT_ALL) != 0, mounts, &estimated, s);
+}
+
+
+/*
+ * EXPAND <dir> / COLLAPSE <dir>: the client loaded or unloaded a subtree of a lazily watched root. A directory
+ * below the lazy depth expands its nearest watched ancestor. Roots are shared, so each session keeps the
+ * directories it expanded: a subtree is collapsed only as far as no other session has it expanded, and
+ * what a session expanded is collapsed that way when it goes away.
+ */
+
+// the directory of the session's roots standing for path, which is cut down to its nearest watched ancestor
+static node_id watched_dir(session* s, char* path) {
+  node_id node = NO_NODE;
+  for (int i=0; i<array_size(s->roots) && node == NO_NODE; i++) {
+    shared_root* root = array_get(s->roots, i);
+    if (root->node == NO_NODE || !is_under(root->path, path)) {
+      continue;
+    }
+    char* slash;
+    while ((node = find_node(root->node, path)) == NO_NODE && strlen(path) > strlen(root->path) &&
+           (slash = strrchr(path, '/')) != NULL) {
+      *slash = '\0';
+    }
+  }
+  return (node != NO_NODE && node_isdir(node) ? node : NO_NODE);
+}
+
+// whether a session other than s has the directory expanded, itself or along with an ancestor
+static bool expanded_elsewhere(session* s, const char* path) {
+  for (int i=0; i<array_size(sessions); i++) {
+    session* other = array_get(sessions, i);
+    if (other != s && covered(other->expanded, path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// keeps the subtree from being collapsed along with an ancestor
+bool is_expanded(const char* path) {
+  for (int i=0; i<array_size(sessions); i++) {
+    session* s = array_get(sessions, i);
+    for (int j=0; j<array_size(s->expanded); j++) {
+      if (strcmp(array_get(s->expanded, j), path) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
 
-  if (!register_roots(new_roots, UNWATCHABLE)) {
+// forgets the directories the session expanded at or below path
+static void forget_expanded(session* s, const char* path) {
+  for (int i=array_size(s->expanded) - 1; i >= 0; i--) {
+    char* dir = array_get(s->expanded, i);
+    if (is_under(path, dir)) {
+      array_remove(s->expanded, i);
+      free(dir);
+    }
+  }
+}
+
+// for a session going away
+static void collapse_expanded(session* s) {
+  char* dir;
+  while ((dir = array_pop(s->expanded)) != NULL) {
+    char path[PATH_MAX];
+    strncpy(path, dir, PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
+    node_id node = watched_dir(s, path);
+    if (node != NO_NODE && strcmp(path, dir) == 0 && !expanded_elsewhere(s, dir)) {
+      collapse(node);
+    }
+    free(dir);
+  }
+}
+
+static bool update_expanded(session* s, bool expanded) {
+  char* line = next_line(s);
+  if (line == NULL) {
     return false;
   }
+  char buf[PATH_MAX], path[PATH_MAX];
+  strncpy(path, (realpath(line, buf) != NULL ? buf : line), PATH_MAX - 1);
+  path[PATH_MAX - 1] = '\0';
 
-  // todo: sort/optimize list
-  output("UNWATCHEABLE\n");
-  for (int i=0; i<array_size(UNWATCHABLE); i++) {
-    char* s = array_get(UNWATCHABLE, i);
-    output("%s\n", s);
-    userlog(LOG_INFO, "unwatchable: %s", s);
+  node_id node = watched_dir(s, path);
+  if (node == NO_NODE) {
+    userlog(LOG_INFO, "nothing to %s: %s", expanded ? "expand" : "collapse", line);
   }
-  output("#\n");
+  else if (expanded) {
+    if (!covered(s->expanded, path)) {
+      char* copy = strdup(path);
+      if (copy == NULL || array_push(s->expanded, copy) == NULL) {
+        userlog(LOG_ERR, "out of memory");
+        free(copy);
+        return false;
+      }
+    }
+    expand(node);
+  }
+  else {
+    forget_expanded(s, path);
+    if (expanded_elsewhere(s, path)) {
+      userlog(LOG_INFO, "still expanded elsewhere: %s", path);
+    } else {
+      collapse(node);
+    }
+  }
+  return true;
+}
+
+
+// replaces the hot set of the current session
+static bool update_hot_paths(array* hot_paths) {
+  userlog(LOG_INFO, "updating hot paths (curr:%d, new:%d)", array_size(current->hot), array_size(hot_paths));
 
-  array_delete_vs_data(UNWATCHABLE);
-  array_delete(new_roots);
+  for (int i=0; i<array_size(hot_paths); i++) {
+    char buf[PATH_MAX];
+    char* path = array_get(hot_paths, i);
+    if (realpath(path, buf) != NULL && strcmp(buf, path) != 0) {
+      char* normalized = strdup(buf);
+      CHECK_NULL(normalized);
+      array_put(hot_paths, i, normalized);
+      free(path);
+    }
+  }
 
+  hot_count += array_size(hot_paths) - array_size(current->hot);
+  array_delete_vs_data(current->hot);
+  current->hot = hot_paths;
   return true;
 }
 
 
+static void unwatch_root(shared_root* root) {
+  node_id holder = root->node;
+  if (holder != NO_NODE) {
+    cancel_watch(root);
+    for (int i=0; i<node_kid_count(holder); i++) {
+      node_id kid = node_kid(holder, i);
+      if (kid != NO_NODE) {
+        unwatch(kid);
+      }
+    }
+    for (int i=0; i<array_size(ROOTS); i++) {
+      if (PTR_NODE(array_get(ROOTS, i)) == holder) {
+        array_remove(ROOTS, i);
+        break;
+      }
+    }
+    vcs_unwatch(holder);
+    node_delete(holder);
+    root->node = NO_NODE;
+  }
+}
+
+
+static void drop_root(shared_root* root) {
+  userlog(LOG_INFO, "unregistering root: %s", root->path);
+  unwatch_root(root);
+  free(root->path);
+  free(root);
+}
+
+
+// the background crawl of a root finished; a failed root becomes unwatchable for every session holding it
+static void root_crawled(void* data, int result) {
+  shared_root* root = data;
+  if (result == ERR_ABORT) {
+    loop_stop();
+    return;
+  }
+  else if (result >= 0) {
+    root->ready = true;
+    userlog(LOG_INFO, "root ready: %s", root->path);
+    if (ready_order != NULL) {
+      array_push(ready_order, root);
+    }
+  }
+  else {
+    userlog(LOG_WARNING, "root became unwatchable: %s", root->path);
+    unwatch_root(root);
+  }
+
+  session* prev = current;
+  for (int i=0; i<array_size(sessions); i++) {
+    session* s = array_get(sessions, i);
+    for (int j=0; j<array_size(s->roots); j++) {
+      if (array_get(s->roots, j) == root) {
+        current = s;
+        if (root->ready) {
+          output("READY\n%s\n", root->path);
+        }
+        else if (!report_unwatchable(s, "UNWATCHEABLE")) {
+          loop_stop();
+        }
+        break;
+      }
+    }
+  }
+  current = prev;
+}
+
+
+static void release_roots(array* roots) {
+  shared_root* root;
+  while ((root = array_pop(roots)) != NULL) {
+    if (--root->refs > 0) {
+      continue;
+    }
+    for (int i=0; i<array_size(shared_roots); i++) {
+      if (array_get(shared_roots, i) == root) {
+        array_remove(shared_roots, i);
+        break;
+      }
+    }
+    drop_root(root);
+  }
+}
+
+
 static void unregister_roots() {
-  watch_node* root;
-  while ((root = array_pop(ROOTS)) != NULL) {
-    userlog(LOG_INFO, "unregistering root: %s", root->name);
-    unwatch(root->wd);
-    free(root->name);
+  shared_root* root;
+  while ((root = array_pop(shared_roots)) != NULL) {
+    drop_root(root);
+  }
+}
+
+
+static shared_root* retain_root(const char* path, int mask, array* unwatchable) {
+  char buf[PATH_MAX];
+  const char* normalized = realpath(path, buf);
+  if (normalized == NULL) {
+    normalized = path;
+  }
+
+  for (int i=0; i<array_size(shared_roots); i++) {
+    shared_root* root = array_get(shared_roots, i);
+    if (strcmp(root->path, normalized) == 0 && root->mask == mask) {
+      root->refs++;
+      return root;
+    }
+  }
+
+  shared_root* root = calloc(1, sizeof(shared_root));
+  node_id holder = node_create(NULL, -1, true, NO_NODE);
+  if (root == NULL || holder == NO_NODE || (root->path = strdup(normalized)) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    if (holder != NO_NODE)  node_delete(holder);
     free(root);
-  };
+    return NULL;
+  }
+
+  root->mask = mask;
+  nodes.flags[holder] |= (mask & ROOT_CHANGES ? 0 : NODE_NOCHANGE) | (mask & ROOT_STATS ? 0 : NODE_NOSTATS);
+
+  userlog(LOG_INFO, "registering root: %s", root->path);
+  int id = watch(root->path, holder, unwatchable, &root_crawled, root);
+  if (id == ERR_ABORT) {
+    node_delete(holder);
+    free(root->path);
+    free(root);
+    return NULL;
+  }
+  else if (id >= 0) {
+    nodes.wd[holder] = id;
+    root->node = holder;
+    if (array_push(ROOTS, NODE_PTR(holder)) == NULL) {
+      userlog(LOG_ERR, "out of memory");
+      return NULL;
+    }
+  }
+  else {
+    if (show_warning && watch_limit_reached()) {
+      int limit = get_watch_count();
+      userlog(LOG_WARNING, "watch limit (%d) reached", limit);
+      //output("MESSAGE\n" INOTIFY_LIMIT_MSG, limit);
+      show_warning = false;  // warn only once
+    }
+    node_delete(holder);
+  }
+
+  root->refs = 1;
+  if (array_push(shared_roots, root) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return NULL;
+  }
+  return root;
 }
 
 
 static bool register_roots(array* new_roots, array* unwatchable) {
   for (int i=0; i<array_size(new_roots); i++) {
-    char* new_root = array_get(new_roots, i);
-	watch_node* root = calloc(1,sizeof(watch_node));
-    userlog(LOG_INFO, "registering root: %s", new_root);
-    int id = watch(new_root, root, unwatchable);
-    if (id == ERR_ABORT) {
+    int mask;
+    const char* new_root = parse_root(array_get(new_roots, i), &mask);
+    shared_root* root = retain_root(new_root, mask, unwatchable);
+    if (root == NULL) {
       return false;
-    } else if (id >= 0) {
-      CHECK_NULL(array_push(ROOTS, root));
-    } else {
-      if (show_warning && watch_limit_reached()) {
-        int limit = get_watch_count();
-        userlog(LOG_WARNING, "watch limit (%d) reached", limit);
-        //output("MESSAGE\n" INOTIFY_LIMIT_MSG, limit);
-        show_warning = false;  // warn only once
-      }
-      CHECK_NULL(array_push(unwatchable, new_root));
+    }
+    CHECK_NULL(array_push(current->roots, root));
+    if (root->node == NO_NODE) {
+      CHECK_NULL(array_push(unwatchable, strdup(new_root)));
+    }
+  }
+
+  return true;
+}
+
+// the front of the shards merges replies to ROOTS and passes later notices on as they are
+static const char* roots_reply() {
+  return (shard >= 0 ? SHARD_ROOTS_REPLY : "UNWATCHEABLE");
+}
+
+// sends the unwatchable mounts and the roots of the session that could not be watched
+static bool report_unwatchable(session* s, const char* type) {
+  array* mounts = array_create(20);
+  CHECK_NULL(mounts);
+  if (!unwatchable_mounts(mounts)) {
+    array_delete_vs_data(mounts);
+    return false;
+  }
+
+  session* prev = current;
+  current = s;
+  // todo: sort/optimize list
+  output("%s\n", type);
+  for (int i=0; i<array_size(mounts); i++) {
+    char* mount = array_get(mounts, i);
+    output("%s\n", mount);
+    userlog(LOG_INFO, "unwatchable: %s", mount);
+  }
+  for (int i=0; i<array_size(s->roots); i++) {
+    shared_root* root = array_get(s->roots, i);
+    if (root->node == NO_NODE) {
+      output("%s\n", root->path);
+      userlog(LOG_INFO, "unwatchable: %s", root->path);
     }
   }
+  output("#\n");
+  current = prev;
 
+  array_delete_vs_data(mounts);
   return true;
 }
 
@@ -352,27 +1429,284 @@ static void inotify_callback(char* path, int fflags)
 {
 
 	if((fflags & NOTE_EXTEND) || (fflags & NOTE_WRITE)) {
-		output("CHANGE\n%s\n",path);
+		output_event("CHANGE", path);
     	userlog(LOG_DEBUG, "CHANGE:%s",path);
 	}
 	
 	if(fflags & NOTE_ATTRIB) {
-		output("STATS\n%s\n",path);
+		output_event("STATS", path);
     	userlog(LOG_DEBUG, "STATS:%s",path);
 	}
 
 	if((fflags & NOTE_DELETE) || (fflags & NOTE_RENAME)) {
-		output("DELETE\n%s\n",path);
+		output_event("DELETE", path);
     	userlog(LOG_DEBUG, "DELETE:%s",path);
 	}
 
 	if((fflags & NOTE_REVOKE)) {
-		output("RESET\n%s\n",path);
+		output_event("RESET", path);
     	userlog(LOG_DEBUG, "RESET:%s",path);
 	}
 
 }
 
+// session lookup: events are delivered only to the sessions whose roots contain the path
+static bool is_under(const char* root, const char* path) {
+  int l = strlen(root);
+  return strncmp(path, root, l) == 0 && (path[l] == '\0' || path[l] == '/' || (l > 0 && root[l-1] == '/'));
+}
+
+// the ROOT_* flag a root needs to get events of the type; other types go to every root
+static int event_mask(const char* type) {
+  return (strcmp(type, "CHANGE") == 0 ? ROOT_CHANGES : strcmp(type, "STATS") == 0 ? ROOT_STATS : 0);
+}
+
+static bool session_watches(session* s, const char* path, int mask) {
+  for (int i=0; i<array_size(s->roots); i++) {
+    shared_root* root = array_get(s->roots, i);
+    if (root->node != NO_NODE && (root->mask & mask) == mask && is_under(root->path, path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool has_hot_paths() {
+  return hot_count > 0;
+}
+
+static bool session_hot(session* s, const char* path) {
+  for (int i=0; i<array_size(s->hot); i++) {
+    if (is_under(array_get(s->hot, i), path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool is_hot_path(const char* path) {
+  for (int i=0; i<array_size(sessions); i++) {
+    if (session_hot(array_get(sessions, i), path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Coalescing: while the output queue of a session is congested its events are held back as the directories
+ * they happened in, and past DIRTY_LIMIT directories as their roots. Once the queue drains, the client
+ * gets RECDIRTY for each directory and RESET for each root instead of the events.
+ */
+#define DIRTY_LIMIT 256
+
+// whether a path is under one of the paths
+static bool covered(array* paths, const char* path) {
+  for (int i=0; i<array_size(paths); i++) {
+    if (is_under(array_get(paths, i), path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void drop_covered(array* paths, const char* path) {
+  for (int i=0; i<array_size(paths); ) {
+    if (is_under(path, array_get(paths, i))) {
+      free(array_remove(paths, i));
+    } else {
+      i++;
+    }
+  }
+}
+
+static void hold_back(session* s, const char* type, const char* path) {
+  const char* root = NULL;
+  for (int i=0; i<array_size(s->roots); i++) {
+    shared_root* r = array_get(s->roots, i);
+    if (r->node != NO_NODE && is_under(r->path, path) && (root == NULL || strlen(r->path) > strlen(root))) {
+      root = r->path;
+    }
+  }
+  s->coalesced++;
+  if (covered(s->reset, path)) {
+    return;
+  }
+
+  char dir[PATH_MAX];
+  strncpy(dir, path, PATH_MAX - 1);
+  dir[PATH_MAX - 1] = '\0';
+  char* slash = strrchr(dir, '/');
+  if (strcmp(type, "RECDIRTY") != 0 && (root == NULL || strcmp(root, path) != 0) && slash != NULL) {
+    slash[slash == dir ? 1 : 0] = '\0';
+  }
+  if (covered(s->dirty, dir)) {
+    return;
+  }
+
+  array* held = s->dirty;
+  if (array_size(s->dirty) >= DIRTY_LIMIT) {
+    held = s->reset;
+    if (root != NULL) {
+      strcpy(dir, root);
+    }
+    drop_covered(s->dirty, dir);
+  }
+  drop_covered(held, dir);
+  char* copy = strdup(dir);
+  if (copy == NULL || array_push(held, copy) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    free(copy);
+  }
+}
+
+/*
+ * Into the ring if the session has one, through the output queue otherwise; false when the ring is full.
+ * Once ATTRIBUTES is answered, CHANGE, STATS and CREATE records get a third line like LIST STAT entries have,
+ * "<inode> <size> <mtime>.<ns> <mode, octal>", or "-" when the path is gone.
+ */
+static bool send_event(session* s, const char* type, const char* path) {
+  struct stat st;
+  bool attributed = s->attributed &&
+      (strcmp(type, "CHANGE") == 0 || strcmp(type, "STATS") == 0 || strcmp(type, "CREATE") == 0);
+  bool known = attributed && event_stat(path, &st);
+
+  if (s->ring == NULL || !ring_accepts(type)) {
+    if (s->numbered) {
+      queue_printf(s->queue, "%s %lu\n%s\n", type, ++s->seq, path);
+    } else {
+      queue_printf(s->queue, "%s\n%s\n", type, path);
+      s->seq++;
+    }
+    if (known) {
+      queue_printf(s->queue, "%llu %lld %lld.%09ld %o\n", (unsigned long long) st.st_ino, (long long) st.st_size,
+                   (long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec, (unsigned int) st.st_mode);
+    } else if (attributed) {
+      queue_printf(s->queue, "-\n");
+    }
+    return true;
+  }
+  if (!ring_put(s->ring, type, path, s->seq + 1, known ? &st : NULL)) {
+    return false;
+  }
+  s->seq++;
+  if (ring_take_waiter(s->ring)) {
+    queue_printf(s->queue, "WAKE\n");
+  }
+  return true;
+}
+
+// sends what was held back; false if some of it did not fit into the ring
+static bool send_held(session* s) {
+  char* path;
+  while ((path = array_pop(s->reset)) != NULL) {
+    if (!send_event(s, "RESET", path)) {
+      array_push(s->reset, path);
+      return false;
+    }
+    free(path);
+  }
+  while ((path = array_pop(s->dirty)) != NULL) {
+    if (!send_event(s, "RECDIRTY", path)) {
+      array_push(s->dirty, path);
+      return false;
+    }
+    free(path);
+  }
+  return true;
+}
+
+#define RING_POLL_MS 10
+
+static void poll_ring(void* data) {
+  session* s = data;
+  s->ring_timer = NULL;
+  if (ring_used(s->ring) > ring_capacity(s->ring) / 2 || !send_held(s)) {
+    s->ring_timer = loop_add_timer(RING_POLL_MS, &poll_ring, s);
+  }
+}
+
+static void session_drained(void* data) {
+  session* s = data;
+  if (!send_held(s) && s->ring_timer == NULL) {
+    s->ring_timer = loop_add_timer(RING_POLL_MS, &poll_ring, s);
+  }
+  if (s->paused && loop_add_source(fileno(s->in), &session_input, s)) {
+    s->paused = false;
+  }
+}
+
+void output_event(const char* type, const char* path) {
+#ifdef DEBUG
+  if (self_test) {
+    return;
+  }
+#endif /* defined DEBUG */
+
+  if (vcs_hold(type, path)) {
+    return;
+  }
+  int mask = event_mask(type);
+  for (int i=0; i<array_size(sessions); i++) {
+    session* s = array_get(sessions, i);
+    if ((array_size(sessions) == 1 && mask == 0) || session_watches(s, path, mask)) {
+      // hot paths are never coalesced: the client is waiting for exactly these events
+      bool holding = queue_congested(s->queue) || array_size(s->dirty) > 0 || array_size(s->reset) > 0;
+      if (holding && !session_hot(s, path)) {
+        hold_back(s, type, path);
+      } else if (!send_event(s, type, path)) {
+        hold_back(s, type, path);
+        if (s->ring_timer == NULL) {
+          s->ring_timer = loop_add_timer(RING_POLL_MS, &poll_ring, s);
+        }
+      }
+    }
+  }
+}
+
+
+/*
+ * SYNC: a barrier. Kernel events already queued are handled, pending re-scans finished, and events delayed
+ * (settling writes, dirty coarse directories, what congestion held back) sent; then the reply gives the number
+ * of the last event record sent. Records are numbered from 1 per session, whether they carry the number
+ * (after SEQUENCE) or not. Only events held for a VCS batch come later, with higher numbers, along with
+ * held-back records a full event ring has no room for.
+ */
+static bool answer_sync(session* s) {
+  if (!loop_drain_events() || !finish_rescans()) {
+    return false;
+  }
+  flush_delayed_events();
+  send_held(s);
+  output("SYNC\n%lu\n", s->seq);
+  return true;
+}
+
+
+/*
+ * RING <file>: events go to an event ring in a new file of that name from now on (see ring.c); an empty
+ * file name goes back to the pipe. The reply gives the capacity of the ring, 0 if events stay on the pipe.
+ */
+static bool open_ring(session* s) {
+  char* line = next_line(s);
+  if (line == NULL) {
+    return false;
+  }
+  if (s->ring != NULL && !send_held(s)) {
+    userlog(LOG_WARNING, "event ring closed with events held back");
+  }
+  loop_cancel_timer(s->ring_timer);
+  s->ring_timer = NULL;
+  ring_delete(s->ring);
+  s->ring = (strlen(line) > 0 ? ring_create(line) : NULL);
+
+  output("RING\n%zu\n", s->ring != NULL ? ring_capacity(s->ring) : 0);
+  if (array_size(s->dirty) > 0 || array_size(s->reset) > 0) {
+    session_drained(s);
+  }
+  return true;
+}
+
 void output(const char* format, ...) {
 #ifdef DEBUG
   if (self_test) {
@@ -380,8 +1714,12 @@ void output(const char* format, ...) {
   }
 #endif /* defined DEBUG */
 
+  if (current == NULL) {
+    return;
+  }
+
   va_list ap;
   va_start(ap, format);
-  vprintf(format, ap);
+  queue_vprintf(current->queue, format, ap);
   va_end(ap);
 }
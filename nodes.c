@@ -0,0 +1,198 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define INITIAL_NODES 1024
+#define NODE_BYTES (sizeof(char*) + sizeof(int) + 4 * sizeof(node_id) + sizeof(uint16_t) + \
+                    sizeof(unsigned int) + sizeof(kid_list))
+// names and spilled kid lists are separate heap blocks; small ones are rounded up to 16-byte size classes
+#define HEAP_BYTES(size) ((size) > 0 ? ((size) + 15) & ~(size_t) 15 : 0)
+
+// grows one column of the store; columns grown before a failure just keep the extra room
+#define GROW_COLUMN(column, capacity) { \
+    void* p = realloc(nodes.column, sizeof(*nodes.column) * (capacity)); \
+    if (p == NULL)  return false; \
+    nodes.column = p; \
+  }
+
+node_store nodes;
+
+
+static bool grow_store() {
+  uint32_t capacity = (nodes.capacity > 0 ? nodes.capacity * 2 : INITIAL_NODES);
+  GROW_COLUMN(name, capacity);
+  GROW_COLUMN(wd, capacity);
+  GROW_COLUMN(parent, capacity);
+  GROW_COLUMN(alias, capacity);
+  GROW_COLUMN(flags, capacity);
+  GROW_COLUMN(older, capacity);
+  GROW_COLUMN(newer, capacity);
+  GROW_COLUMN(churn, capacity);
+  GROW_COLUMN(kids, capacity);
+  if (nodes.capacity == 0) {
+    nodes.used = 1;  // NO_NODE
+  }
+  nodes.capacity = capacity;
+  return true;
+}
+
+
+node_id node_create(const char* name, int wd, bool isdir, node_id parent) {
+  char* copy = NULL;
+  if (name != NULL && (copy = strdup(name)) == NULL) {
+    return NO_NODE;
+  }
+
+  node_id n = nodes.free_list;
+  if (n != NO_NODE) {
+    nodes.free_list = nodes.parent[n];
+  }
+  else if (nodes.used < nodes.capacity || grow_store()) {
+    n = nodes.used++;
+  }
+  else {
+    free(copy);
+    return NO_NODE;
+  }
+
+  nodes.name[n] = copy;
+  nodes.wd[n] = wd;
+  nodes.parent[n] = parent;
+  nodes.alias[n] = NO_NODE;
+  nodes.flags[n] = (isdir ? NODE_DIR : 0);
+  nodes.older[n] = nodes.newer[n] = NO_NODE;
+  nodes.churn[n] = 0;
+  memset(&nodes.kids[n], 0, sizeof(kid_list));
+  return n;
+}
+
+
+// frees the node itself; kids and the slot in the parent are the caller's business
+void node_delete(node_id n) {
+  free(nodes.name[n]);
+  if (nodes.kids[n].capacity > 0) {
+    free(nodes.kids[n].u.ids);
+  }
+  nodes.name[n] = NULL;
+  nodes.flags[n] = 0;
+  nodes.kids[n].size = nodes.kids[n].capacity = 0;
+  nodes.parent[n] = nodes.free_list;
+  nodes.free_list = n;
+}
+
+
+// puts a kid into a free (NO_NODE) slot, or appends it; inline kids move to the heap when they do not fit
+bool node_add_kid(node_id n, node_id kid) {
+  kid_list* k = &nodes.kids[n];
+  node_id* ids = node_kids(n);
+  for (uint32_t i=0; i<k->size; i++) {
+    if (ids[i] == NO_NODE) {
+      ids[i] = kid;
+      return true;
+    }
+  }
+
+  uint32_t capacity = (k->capacity > 0 ? k->capacity : INLINE_KIDS);
+  if (k->size == capacity) {
+    node_id* p;
+    if (k->capacity == 0) {
+      if ((p = malloc(sizeof(node_id) * capacity * 2)) == NULL) {
+        return false;
+      }
+      memcpy(p, k->u.inline_ids, sizeof(k->u.inline_ids));
+    }
+    else if ((p = realloc(k->u.ids, sizeof(node_id) * capacity * 2)) == NULL) {
+      return false;
+    }
+    k->u.ids = p;
+    k->capacity = capacity * 2;
+  }
+  node_kids(n)[k->size++] = kid;
+  return true;
+}
+
+
+// drops free slots and gives unused heap back; small lists go inline again
+void node_compact_kids(node_id n) {
+  kid_list* k = &nodes.kids[n];
+  node_id* ids = node_kids(n);
+  uint32_t size = 0;
+  for (uint32_t i=0; i<k->size; i++) {
+    if (ids[i] != NO_NODE) {
+      ids[size++] = ids[i];
+    }
+  }
+  k->size = size;
+
+  if (k->capacity > 0 && size <= INLINE_KIDS) {
+    memcpy(k->u.inline_ids, ids, sizeof(node_id) * size);
+    free(ids);
+    k->capacity = 0;
+  }
+  else if (k->capacity > size) {
+    node_id* p = realloc(ids, sizeof(node_id) * size);
+    if (p != NULL) {
+      k->u.ids = p;
+      k->capacity = size;
+    }
+  }
+}
+
+
+size_t node_kids_memory(node_id n) {
+  return HEAP_BYTES(sizeof(node_id) * nodes.kids[n].capacity);
+}
+
+
+// bytes taken by the node: its share of the store and the heap blocks of its name and spilled kids
+size_t node_memory(node_id n) {
+  return NODE_BYTES + (nodes.name[n] != NULL ? HEAP_BYTES(strlen(nodes.name[n]) + 1) : 0) + node_kids_memory(n);
+}
+
+
+// what node_memory() would give for a node with a name of this length and that many kids
+size_t node_estimate(size_t name_length, uint32_t kid_count) {
+  uint32_t capacity = 0;
+  if (kid_count > INLINE_KIDS) {
+    for (capacity = INLINE_KIDS * 2; capacity < kid_count; capacity *= 2);
+  }
+  return NODE_BYTES + HEAP_BYTES(name_length + 1) + HEAP_BYTES(sizeof(node_id) * capacity);
+}
+
+
+void close_nodes() {
+  for (uint32_t n=1; n<nodes.used; n++) {
+    free(nodes.name[n]);
+    if (nodes.kids[n].capacity > 0) {
+      free(nodes.kids[n].u.ids);
+    }
+  }
+  free(nodes.name);
+  free(nodes.wd);
+  free(nodes.parent);
+  free(nodes.alias);
+  free(nodes.flags);
+  free(nodes.older);
+  free(nodes.newer);
+  free(nodes.churn);
+  free(nodes.kids);
+  memset(&nodes, 0, sizeof(nodes));
+}
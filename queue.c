@@ -0,0 +1,219 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+/*
+ * Output queue: the descriptor is non-blocking, so a client that stops reading never stalls the loop.
+ * What the descriptor does not take right away waits in the buffer, and is written out whenever the loop
+ * sees the descriptor writable. Past the high-water mark the queue is congested: its owner is expected
+ * to hold back what it can (see output_event()) until the queue is written out down to the low-water mark.
+ */
+#define QUEUE_INITIAL_LEN 4096
+#define QUEUE_HIGH_WATER (1024 * 1024)
+#define QUEUE_LOW_WATER (64 * 1024)
+
+struct __out_queue {
+  int fd;
+  int fd_flags;  // as found, restored on deletion
+  char* buf;
+  size_t start, end, capacity;
+  bool waiting;    // a writer is registered with the loop
+  bool congested;
+  bool broken;     // the reader is gone; output is dropped
+  drain_callback drained;
+  void* data;
+};
+
+
+out_queue* queue_create(int fd, drain_callback drained, void* data) {
+  out_queue* q = calloc(1, sizeof(out_queue));
+  if (q == NULL || (q->buf = malloc(QUEUE_INITIAL_LEN)) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    free(q);
+    return NULL;
+  }
+  q->fd = fd;
+  q->capacity = QUEUE_INITIAL_LEN;
+  q->drained = drained;
+  q->data = data;
+
+  q->fd_flags = fcntl(fd, F_GETFL);
+  if (q->fd_flags < 0 || fcntl(fd, F_SETFL, q->fd_flags | O_NONBLOCK) < 0) {
+    userlog(LOG_WARNING, "fcntl(%d): %s", fd, strerror(errno));  // works, just blocking
+  }
+  return q;
+}
+
+
+static bool writable(void* data);
+
+static void flush(out_queue* q) {
+  while (q->start < q->end) {
+    ssize_t n = write(q->fd, q->buf + q->start, q->end - q->start);
+    if (n > 0) {
+      q->start += n;
+    }
+    else if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    else if (n < 0 && errno == EAGAIN) {
+      break;
+    }
+    else {
+      userlog(LOG_WARNING, "output to %d failed: %s", q->fd, strerror(errno));
+      q->broken = true;
+      q->start = q->end;
+    }
+  }
+  if (q->start == q->end) {
+    q->start = q->end = 0;
+  }
+
+  bool pending = (q->start < q->end);
+  if (pending && !q->waiting) {
+    q->waiting = loop_add_writer(q->fd, &writable, q);
+  }
+  else if (!pending && q->waiting) {
+    loop_remove_writer(q->fd);
+    q->waiting = false;
+  }
+
+  if (q->congested && q->end - q->start <= QUEUE_LOW_WATER) {
+    q->congested = false;
+    userlog(LOG_INFO, "output to %d drained", q->fd);
+    if (q->drained != NULL) {
+      q->drained(q->data);
+    }
+  }
+}
+
+static bool writable(void* data) {
+  flush(data);
+  return true;
+}
+
+
+static bool reserve(out_queue* q, size_t len) {
+  if (q->start > 0) {
+    memmove(q->buf, q->buf + q->start, q->end - q->start);
+    q->end -= q->start;
+    q->start = 0;
+  }
+  if (q->end + len <= q->capacity) {
+    return true;
+  }
+
+  size_t capacity = q->capacity;
+  while (capacity < q->end + len) {
+    capacity *= 2;
+  }
+  char* buf = realloc(q->buf, capacity);
+  if (buf == NULL) {
+    return false;
+  }
+  q->buf = buf;
+  q->capacity = capacity;
+  return true;
+}
+
+
+void queue_vprintf(out_queue* q, const char* format, va_list ap) {
+  if (q->broken) {
+    return;
+  }
+
+  va_list copy;
+  va_copy(copy, ap);
+  int len = vsnprintf(q->buf + q->end, q->capacity - q->end, format, copy);
+  va_end(copy);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t) len >= q->capacity - q->end) {
+    if (!reserve(q, len + 1)) {
+      userlog(LOG_ERR, "out of memory");
+      return;
+    }
+    vsnprintf(q->buf + q->end, q->capacity - q->end, format, ap);
+  }
+  q->end += len;
+
+  if (!q->waiting) {
+    flush(q);
+  }
+  if (!q->congested && q->end - q->start > QUEUE_HIGH_WATER) {
+    q->congested = true;
+    userlog(LOG_WARNING, "output to %d congested: %zu bytes queued", q->fd, q->end - q->start);
+  }
+}
+
+
+void queue_printf(out_queue* q, const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  queue_vprintf(q, format, ap);
+  va_end(ap);
+}
+
+
+bool queue_congested(out_queue* q) {
+  return q->congested;
+}
+
+
+size_t queue_length(out_queue* q) {
+  return q->end - q->start;
+}
+
+
+// what is still queued is written out as far as the descriptor takes it right away, and dropped after that;
+// with 'finish' it is written out blocking, for a reader that expects the rest (standard output at exit)
+void queue_delete(out_queue* q, bool finish) {
+  if (q == NULL) {
+    return;
+  }
+  if (q->waiting) {
+    loop_remove_writer(q->fd);
+  }
+  if (finish && q->fd_flags >= 0) {
+    fcntl(q->fd, F_SETFL, q->fd_flags);
+  }
+  while (!q->broken && q->start < q->end) {
+    ssize_t n = write(q->fd, q->buf + q->start, q->end - q->start);
+    if (n > 0) {
+      q->start += n;
+    } else if (n < 0 && errno != EINTR) {
+      break;
+    }
+  }
+  if (!q->broken && q->start < q->end) {
+    userlog(LOG_WARNING, "output to %d closed: %zu bytes dropped", q->fd, q->end - q->start);
+  }
+  if (!finish && q->fd_flags >= 0) {
+    fcntl(q->fd, F_SETFL, q->fd_flags);
+  }
+  free(q->buf);
+  free(q);
+}
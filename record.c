@@ -0,0 +1,714 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*
+ * Recordings: the kernel events of a session together with what the crawler saw, so that a workload can be
+ * replayed later, on any machine, against the same code. The file is a header followed by records of a type
+ * byte and fields; numbers are LEB128 varints, strings are a length and the bytes.
+ *
+ *   R count path...           ROOTS command
+ *   W wd isdir path           watch added
+ *   U wd                      watch removed
+ *   D wd isdir name           directory entry read by the crawler; wd is the directory's
+ *   Z wd                      end of a complete directory listing
+ *   E usec count (wd fflags)  kernel events; usec since the previous batch
+ *
+ * Watches and listings following an R or E record are what the crawler found in response to it.
+ */
+#define RECORD_MAGIC "FSNR"
+#define RECORD_VERSION 1
+#define RECORD_BUF_SIZE 65536
+
+enum {
+  REC_ROOTS = 'R',
+  REC_WATCH = 'W',
+  REC_UNWATCH = 'U',
+  REC_ENTRY = 'D',
+  REC_LISTED = 'Z',
+  REC_EVENTS = 'E'
+};
+
+static FILE* record_file = NULL;
+static uint64_t last_batch = 0;
+static bool replay_mode = false;
+
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void put_varint(uint64_t v) {
+  while (v >= 0x80) {
+    putc((int) (v & 0x7f) | 0x80, record_file);
+    v >>= 7;
+  }
+  putc((int) v, record_file);
+}
+
+static void put_string(const char* s) {
+  size_t len = strlen(s);
+  put_varint(len);
+  fwrite(s, 1, len, record_file);
+}
+
+
+bool init_recording(const char* path) {
+  if ((record_file = fopen(path, "wb")) == NULL) {
+    userlog(LOG_ERR, "cannot record to %s: %s", path, strerror(errno));
+    return false;
+  }
+  setvbuf(record_file, NULL, _IOFBF, RECORD_BUF_SIZE);
+  fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), record_file);
+  putc(RECORD_VERSION, record_file);
+  last_batch = now_ns();
+  return true;
+}
+
+
+void record_roots(array* roots) {
+  if (record_file != NULL) {
+    putc(REC_ROOTS, record_file);
+    put_varint(array_size(roots));
+    for (int i=0; i<array_size(roots); i++) {
+      put_string(array_get(roots, i));
+    }
+  }
+}
+
+
+void record_watch(int wd, const char* path, bool isdir) {
+  if (record_file != NULL) {
+    putc(REC_WATCH, record_file);
+    put_varint(wd);
+    putc(isdir, record_file);
+    put_string(path);
+  }
+}
+
+
+void record_unwatch(int wd) {
+  if (record_file != NULL) {
+    putc(REC_UNWATCH, record_file);
+    put_varint(wd);
+  }
+}
+
+
+void record_entry(int wd, const char* name, bool isdir) {
+  if (record_file != NULL) {
+    putc(REC_ENTRY, record_file);
+    put_varint(wd);
+    putc(isdir, record_file);
+    put_string(name);
+  }
+}
+
+
+void record_listed(int wd) {
+  if (record_file != NULL) {
+    putc(REC_LISTED, record_file);
+    put_varint(wd);
+  }
+}
+
+
+// a batch as returned by the kernel; flushed right away so that a killed session still leaves a usable recording
+void record_events(struct kevent* events, int count) {
+  if (record_file == NULL) {
+    return;
+  }
+  int vnode = 0;
+  for (int i=0; i<count; i++) {
+    if (events[i].filter == EVFILT_VNODE) {
+      vnode++;
+    }
+  }
+  if (vnode == 0) {
+    return;
+  }
+
+  uint64_t now = now_ns();
+  putc(REC_EVENTS, record_file);
+  put_varint((now - last_batch) / 1000);
+  put_varint(vnode);
+  for (int i=0; i<count; i++) {
+    if (events[i].filter == EVFILT_VNODE) {
+      put_varint(events[i].ident);
+      put_varint(events[i].fflags);
+    }
+  }
+  last_batch = now;
+  fflush(record_file);
+}
+
+
+void close_recording() {
+  if (record_file != NULL) {
+    if (fclose(record_file) != 0) {
+      userlog(LOG_ERR, "recording: %s", strerror(errno));
+    }
+    record_file = NULL;
+  }
+}
+
+
+/*
+ * Replay: the recording is fed through event processing, crawling and output as fast as they go. The file
+ * system is simulated by a scratch directory into which the recorded paths are mapped: before each ROOTS
+ * command or event batch, entries the crawler saw in response to it are created there and complete
+ * listings remove what is not in them. Watches are not registered with the kernel; events come from the
+ * recording only. Time-driven behavior (settling, churn windows) sees the recorded time compressed.
+ */
+#define REPLAY_BATCH 256
+
+typedef struct {
+  const unsigned char* data;
+  size_t size;
+  size_t pos;
+  bool broken;
+} cursor;
+
+static cursor rec;
+static char scratch[PATH_MAX];
+static char** rec_paths = NULL;    // recorded wd -> recorded path
+static array** listings = NULL;    // recorded wd -> names seen since the listing began
+static int rec_paths_len = 0;
+static int commands_fd = -1;
+static timer* step_timer = NULL;
+
+static struct kevent* batch = NULL;
+static int batch_len = 0;
+static uint64_t* latencies = NULL;
+static size_t latency_count = 0;
+static size_t latency_len = 0;
+
+static unsigned long events_fed = 0;
+static unsigned long events_unmatched = 0;
+static uint64_t recorded_us = 0;
+static uint64_t busy_ns = 0;
+static uint64_t crawl_start = 0;
+static uint64_t crawl_ns = 0;
+
+
+inline bool replaying() {
+  return replay_mode;
+}
+
+
+static uint64_t get_varint() {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (rec.pos >= rec.size) {
+      break;
+    }
+    unsigned char b = rec.data[rec.pos++];
+    v |= (uint64_t) (b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return v;
+    }
+  }
+  rec.broken = true;
+  return 0;
+}
+
+static int get_byte() {
+  if (rec.pos >= rec.size) {
+    rec.broken = true;
+    return 0;
+  }
+  return rec.data[rec.pos++];
+}
+
+// returns the string in buf (of PATH_MAX bytes); longer ones break the recording
+static char* get_string(char* buf) {
+  uint64_t len = get_varint();
+  if (len >= PATH_MAX || rec.pos + len > rec.size) {
+    rec.broken = true;
+    len = 0;
+  }
+  memcpy(buf, rec.data + rec.pos, len);
+  buf[len] = '\0';
+  rec.pos += len;
+  return buf;
+}
+
+// the recorded wd as an index, growing the tables when needed; -1 for a broken one
+static int get_wd() {
+  uint64_t wd = get_varint();
+  if (wd >= INT_MAX / 2) {
+    rec.broken = true;
+    return -1;
+  }
+  if ((int) wd >= rec_paths_len) {
+    int len = (rec_paths_len > 0 ? rec_paths_len : 1024);
+    while (len <= (int) wd)  len *= 2;
+    char** paths = realloc(rec_paths, sizeof(char*) * len);
+    if (paths != NULL)  rec_paths = paths;
+    array** lists = realloc(listings, sizeof(array*) * len);
+    if (lists != NULL)  listings = lists;
+    if (paths == NULL || lists == NULL) {
+      rec.broken = true;
+      return -1;
+    }
+    memset(rec_paths + rec_paths_len, 0, sizeof(char*) * (len - rec_paths_len));
+    memset(listings + rec_paths_len, 0, sizeof(array*) * (len - rec_paths_len));
+    rec_paths_len = len;
+  }
+  return (int) wd;
+}
+
+
+static bool map_path(const char* path, char* buf) {
+  return snprintf(buf, PATH_MAX, "%s%s", scratch, path) < PATH_MAX;
+}
+
+// never follows links: everything under the scratch directory was created by the replay
+static void remove_tree(const char* path) {
+  struct stat st;
+  DIR* dir = (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) ? opendir(path) : NULL);
+  struct dirent* entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    char kid[PATH_MAX];
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+        snprintf(kid, sizeof(kid), "%s/%s", path, entry->d_name) < (int) sizeof(kid)) {
+      remove_tree(kid);
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  remove(path);
+}
+
+// makes path exist as a directory or a file, along with its parents
+static void materialize(const char* recorded, bool isdir) {
+  char path[PATH_MAX];
+  struct stat st;
+  if (!map_path(recorded, path)) {
+    return;
+  }
+
+  if (lstat(path, &st) == 0) {
+    if (S_ISDIR(st.st_mode) == isdir) {
+      return;
+    }
+    remove_tree(path);
+  }
+
+  for (char* p = strchr(path + strlen(scratch) + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  if (isdir) {
+    mkdir(path, 0755);
+  } else {
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+// removes whatever the completed listing of the directory did not have
+static void prune(int wd) {
+  char path[PATH_MAX];
+  array* names = listings[wd];
+  listings[wd] = NULL;
+  if (rec_paths[wd] == NULL || !map_path(rec_paths[wd], path)) {
+    array_delete_vs_data(names);
+    return;
+  }
+
+  DIR* dir = opendir(path);
+  struct dirent* entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    bool listed = false;
+    for (int i=0; i<array_size(names) && !listed; i++) {
+      listed = (strcmp(array_get(names, i), entry->d_name) == 0);
+    }
+    if (!listed) {
+      char gone[PATH_MAX];
+      if (snprintf(gone, sizeof(gone), "%s/%s", path, entry->d_name) < (int) sizeof(gone)) {
+        remove_tree(gone);
+      }
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  array_delete_vs_data(names);
+}
+
+
+// applies watches and listings up to the next ROOTS or event record
+static void apply_segment() {
+  char buf[PATH_MAX], path[PATH_MAX];
+
+  while (rec.pos < rec.size && !rec.broken) {
+    int type = rec.data[rec.pos];
+    if (type == REC_ROOTS || type == REC_EVENTS) {
+      return;
+    }
+    rec.pos++;
+
+    int wd;
+    bool isdir;
+    switch (type) {
+      case REC_WATCH:
+        wd = get_wd();
+        isdir = get_byte();
+        get_string(buf);
+        if (wd >= 0) {
+          free(rec_paths[wd]);
+          rec_paths[wd] = strdup(buf);
+          materialize(buf, isdir);
+        }
+        break;
+
+      case REC_UNWATCH:
+        wd = get_wd();
+        if (wd >= 0) {
+          free(rec_paths[wd]);
+          rec_paths[wd] = NULL;
+        }
+        break;
+
+      case REC_ENTRY:
+        wd = get_wd();
+        isdir = get_byte();
+        get_string(buf);
+        if (wd < 0 || rec_paths[wd] == NULL) {
+          break;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", rec_paths[wd], buf) < (int) sizeof(path)) {
+          materialize(path, isdir);
+        }
+        if (listings[wd] == NULL) {
+          listings[wd] = array_create(16);
+        }
+        char* name = strdup(buf);
+        if (name == NULL || array_push(listings[wd], name) == NULL) {
+          free(name);
+        }
+        break;
+
+      case REC_LISTED:
+        wd = get_wd();
+        if (wd >= 0) {
+          prune(wd);
+        }
+        break;
+
+      default:
+        rec.broken = true;
+        break;
+    }
+  }
+}
+
+
+static array* read_roots() {
+  char buf[PATH_MAX], path[PATH_MAX];
+  array* roots = array_create(20);
+  uint64_t count = get_varint();
+  for (uint64_t i=0; i<count && !rec.broken && roots != NULL; i++) {
+    get_string(buf);
+    int mask, prefix = parse_root(buf, &mask) - buf;  // the event mask goes along as is
+    char* root = NULL;
+    memcpy(path, buf, prefix);
+    if (map_path(buf + prefix, path + prefix) && ((root = strdup(path)) == NULL || array_push(roots, root) == NULL)) {
+      free(root);
+      array_delete_vs_data(roots);
+      roots = NULL;
+    }
+  }
+  return roots;
+}
+
+static bool send_roots(array* roots) {
+  FILE* out = fdopen(dup(commands_fd), "w");
+  if (out == NULL) {
+    return false;
+  }
+  fputs("ROOTS\n", out);
+  for (int i=0; i<array_size(roots); i++) {
+    fprintf(out, "%s\n", (char*) array_get(roots, i));
+  }
+  fputs("#\n", out);
+  return fclose(out) == 0;
+}
+
+
+static node_id lookup(const char* path) {
+  for (int i=0; i<array_size(ROOTS); i++) {
+    node_id holder = PTR_NODE(array_get(ROOTS, i));
+    node_id node = (holder != NO_NODE ? find_node(holder, path) : NO_NODE);
+    if (node != NO_NODE) {
+      return node;
+    }
+  }
+  return NO_NODE;
+}
+
+// translates the recorded descriptors of a batch into the ones of the replayed tree
+static int read_batch() {
+  char path[PATH_MAX];
+  recorded_us += get_varint();
+  uint64_t count = get_varint();
+  int n = 0;
+
+  for (uint64_t i=0; i<count && !rec.broken; i++) {
+    int wd = get_wd();
+    unsigned int fflags = get_varint();
+    node_id node;
+    if (wd < 0 || rec_paths[wd] == NULL || !map_path(rec_paths[wd], path) || (node = lookup(path)) == NO_NODE) {
+      events_unmatched++;
+      continue;
+    }
+    if (n == batch_len) {
+      int len = (batch_len > 0 ? batch_len * 2 : REPLAY_BATCH);
+      struct kevent* p = realloc(batch, sizeof(struct kevent) * len);
+      if (p == NULL) {
+        rec.broken = true;
+        break;
+      }
+      batch = p;
+      batch_len = len;
+    }
+    EV_SET(&batch[n], node_wd(node), EVFILT_VNODE, EV_CLEAR, fflags, 0, NULL);
+    n++;
+  }
+  return n;
+}
+
+
+static void add_latency(uint64_t ns) {
+  if (latency_count == latency_len) {
+    size_t len = (latency_len > 0 ? latency_len * 2 : 1024);
+    uint64_t* p = realloc(latencies, sizeof(uint64_t) * len);
+    if (p == NULL) {
+      return;
+    }
+    latencies = p;
+    latency_len = len;
+  }
+  latencies[latency_count++] = ns;
+}
+
+static int compare_latency(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(double p) {
+  return latency_count > 0 ? latencies[(size_t) (p * (latency_count - 1))] / 1000.0 : 0;
+}
+
+static void report() {
+  qsort(latencies, latency_count, sizeof(uint64_t), &compare_latency);
+  double busy = busy_ns / 1e9;
+  fprintf(stderr, "replay: %zu batches, %lu events (%lu unmatched), %d nodes\n",
+          latency_count, events_fed, events_unmatched, get_node_count());
+  fprintf(stderr, "replay: crawls of roots %.3f s; events %.3f s (%.3f s recorded), %.0f events/s\n",
+          crawl_ns / 1e9, busy, recorded_us / 1e6, busy > 0 ? events_fed / busy : 0);
+  fprintf(stderr, "replay: batch latency p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+          percentile_us(0.5), percentile_us(0.9), percentile_us(0.99), percentile_us(1.0));
+}
+
+
+// one ROOTS command or event batch per loop iteration, so that input and timers are handled in between
+static void replay_step(void* data) {
+  step_timer = NULL;
+
+  if (!finish_crawls()) {
+    loop_stop();
+    return;
+  }
+  if (crawl_start != 0) {
+    crawl_ns += now_ns() - crawl_start;
+    crawl_start = 0;
+  }
+
+  if (rec.pos >= rec.size || rec.broken) {
+    if (rec.broken) {
+      fprintf(stderr, "replay: recording is broken at offset %zu\n", rec.pos);
+    }
+    report();
+    loop_stop();
+    return;
+  }
+
+  int type = rec.data[rec.pos++];
+  if (type == REC_ROOTS) {
+    array* roots = read_roots();
+    apply_segment();
+    bool sent = (roots != NULL && send_roots(roots));
+    array_delete_vs_data(roots);
+    if (!sent) {
+      fprintf(stderr, "replay: cannot send roots\n");
+      loop_stop();
+      return;
+    }
+    crawl_start = now_ns();
+  }
+  else if (type == REC_EVENTS) {
+    int n = read_batch();
+    apply_segment();
+    uint64_t start = now_ns();
+    if (!process_inotify_events(batch, n) || !finish_crawls()) {
+      loop_stop();
+      return;
+    }
+    uint64_t ns = now_ns() - start;
+    add_latency(ns);
+    busy_ns += ns;
+    events_fed += n;
+  }
+  else {
+    rec.pos--;
+    apply_segment();  // leading watches and listings, or garbage that breaks the recording
+  }
+
+  step_timer = loop_add_timer(0, &replay_step, NULL);
+}
+
+
+static bool empty_dir(const char* path) {
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    return false;
+  }
+  struct dirent* entry;
+  bool empty = true;
+  while (empty && (entry = readdir(dir)) != NULL) {
+    empty = (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0);
+  }
+  closedir(dir);
+  return empty;
+}
+
+
+bool start_replay(const char* file, const char* dir) {
+  FILE* in = fopen(file, "rb");
+  long size = -1;
+  if (in == NULL || fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) < 0 || fseek(in, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "replay: %s: %s\n", file, strerror(errno));
+    if (in != NULL)  fclose(in);
+    return false;
+  }
+  unsigned char* data = malloc(size > 0 ? size : 1);
+  if (data == NULL || fread(data, 1, size, in) != (size_t) size) {
+    fprintf(stderr, "replay: cannot read %s\n", file);
+    free(data);
+    fclose(in);
+    return false;
+  }
+  fclose(in);
+
+  size_t header = strlen(RECORD_MAGIC);
+  if ((size_t) size <= header || memcmp(data, RECORD_MAGIC, header) != 0 || data[header] != RECORD_VERSION) {
+    fprintf(stderr, "replay: %s is not a recording\n", file);
+    free(data);
+    return false;
+  }
+  rec.data = data;
+  rec.size = size;
+  rec.pos = header + 1;
+  rec.broken = false;
+
+  // replaying removes whatever a listing did not have, so it only ever works in a directory of its own
+  if (mkdir(dir, 0755) != 0) {
+    if (errno != EEXIST) {
+      fprintf(stderr, "replay: %s: %s\n", dir, strerror(errno));
+      return false;
+    }
+    if (!empty_dir(dir)) {
+      fprintf(stderr, "replay: %s: not an empty directory\n", dir);
+      return false;
+    }
+  }
+  if (realpath(dir, scratch) == NULL) {
+    fprintf(stderr, "replay: %s: %s\n", dir, strerror(errno));
+    return false;
+  }
+  if (strcmp(scratch, "/") == 0) {
+    fprintf(stderr, "replay: refusing to replay into /\n");
+    return false;
+  }
+
+  int fds[2];
+  FILE* commands;
+  if (pipe(fds) != 0 || (commands = fdopen(fds[0], "r")) == NULL) {
+    fprintf(stderr, "replay: %s\n", strerror(errno));
+    return false;
+  }
+  commands_fd = fds[1];
+  if (session_create(commands, stdout) == NULL) {
+    return false;
+  }
+
+  replay_mode = true;
+  step_timer = loop_add_timer(0, &replay_step, NULL);
+  return step_timer != NULL;
+}
+
+
+void close_replay() {
+  if (commands_fd >= 0) {
+    close(commands_fd);
+    commands_fd = -1;
+  }
+  for (int i=0; i<rec_paths_len; i++) {
+    free(rec_paths[i]);
+    array_delete_vs_data(listings[i]);
+  }
+  free(rec_paths);
+  free(listings);
+  rec_paths = NULL;
+  listings = NULL;
+  rec_paths_len = 0;
+  free(batch);
+  batch = NULL;
+  free(latencies);
+  latencies = NULL;
+  free((void*) rec.data);
+  rec.data = NULL;
+  step_timer = NULL;  // freed with the loop
+}
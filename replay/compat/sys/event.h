@@ -0,0 +1,89 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __COMPAT_SYS_EVENT_H
+#define __COMPAT_SYS_EVENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// kqueue as declared by FreeBSD; implemented by sim.c
+struct kevent {
+  uintptr_t ident;
+  short filter;
+  unsigned short flags;
+  unsigned int fflags;
+  intptr_t data;
+  void* udata;
+};
+
+#define EV_SET(kevp, a, b, c, d, e, f) do {  \
+    struct kevent* __kevp = (kevp);          \
+    __kevp->ident = (a);                     \
+    __kevp->filter = (b);                    \
+    __kevp->flags = (c);                     \
+    __kevp->fflags = (d);                    \
+    __kevp->data = (e);                      \
+    __kevp->udata = (f);                     \
+  } while (0)
+
+#define EVFILT_READ (-1)
+#define EVFILT_WRITE (-2)
+#define EVFILT_AIO (-3)
+#define EVFILT_VNODE (-4)
+#define EVFILT_PROC (-5)
+#define EVFILT_SIGNAL (-6)
+#define EVFILT_TIMER (-7)
+#define EVFILT_FS (-9)
+#define EVFILT_LIO (-10)
+#define EVFILT_USER (-11)
+#define EVFILT_SYSCOUNT 11
+
+#define EV_ADD 0x0001
+#define EV_DELETE 0x0002
+#define EV_ENABLE 0x0004
+#define EV_DISABLE 0x0008
+#define EV_ONESHOT 0x0010
+#define EV_CLEAR 0x0020
+#define EV_RECEIPT 0x0040
+#define EV_DISPATCH 0x0080
+#define EV_ERROR 0x4000
+#define EV_EOF 0x8000
+
+#define NOTE_FFNOP 0x00000000
+#define NOTE_FFAND 0x40000000
+#define NOTE_FFOR 0x80000000
+#define NOTE_FFCOPY 0xc0000000
+#define NOTE_FFCTRLMASK 0xc0000000
+#define NOTE_FFLAGSMASK 0x00ffffff
+#define NOTE_TRIGGER 0x01000000
+
+#define NOTE_LOWAT 0x0001
+
+#define NOTE_DELETE 0x0001
+#define NOTE_WRITE 0x0002
+#define NOTE_EXTEND 0x0004
+#define NOTE_ATTRIB 0x0008
+#define NOTE_LINK 0x0010
+#define NOTE_RENAME 0x0020
+#define NOTE_REVOKE 0x0040
+
+int kqueue(void);
+int kevent(int kq, const struct kevent* changelist, int nchanges, struct kevent* eventlist, int nevents,
+           const struct timespec* timeout);
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __COMPAT_SYS_MOUNT_H
+#define __COMPAT_SYS_MOUNT_H
+
+#include <stdint.h>
+
+// the part of FreeBSD's getmntinfo() fsnotifier uses; the replay has no mounts to report
+#define MFSNAMELEN 16
+#define MNAMELEN 1024
+
+#define MNT_LOCAL 0x00001000
+#define MNT_NOWAIT 2
+
+struct statfs {
+  uint64_t f_flags;
+  char f_fstypename[MFSNAMELEN];
+  char f_mntfromname[MNAMELEN];
+  char f_mntonname[MNAMELEN];
+};
+
+int getmntinfo(struct statfs** mntbufp, int mode);
+
+#endif
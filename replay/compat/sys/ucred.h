@@ -0,0 +1 @@
+/* nothing of it is used; main.c includes it for getmntinfo() on FreeBSD */
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/event.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+
+/*
+ * Just enough of kqueue for the replay: descriptor readiness (EVFILT_READ, EVFILT_WRITE) is polled and
+ * EVFILT_USER is triggered by hand. Vnode watches are accepted and never fire - their events come from
+ * the recording. There is one queue per process, which is all fsnotifier opens.
+ */
+typedef struct {
+  uintptr_t ident;
+  short filter;
+  bool enabled;
+  bool triggered;  // EVFILT_USER only
+  void* udata;
+} registration;
+
+static registration* regs = NULL;
+static int reg_count = 0;
+static int reg_len = 0;
+static struct pollfd* polled = NULL;
+
+
+int getmntinfo(struct statfs** mntbufp, int mode) {
+  *mntbufp = NULL;
+  return 0;
+}
+
+
+int kqueue(void) {
+  return open("/dev/null", O_RDONLY);  // a descriptor to close, nothing more
+}
+
+
+static registration* find(uintptr_t ident, short filter) {
+  for (int i=0; i<reg_count; i++) {
+    if (regs[i].ident == ident && regs[i].filter == filter) {
+      return &regs[i];
+    }
+  }
+  return NULL;
+}
+
+
+static int apply(const struct kevent* change) {
+  if (change->filter == EVFILT_VNODE || change->filter == EVFILT_TIMER) {
+    return 0;
+  }
+  if (change->filter != EVFILT_READ && change->filter != EVFILT_WRITE && change->filter != EVFILT_USER) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  registration* r = find(change->ident, change->filter);
+  if (change->flags & EV_DELETE) {
+    if (r == NULL) {
+      errno = ENOENT;
+      return -1;
+    }
+    *r = regs[--reg_count];
+    return 0;
+  }
+  if (r == NULL) {
+    if (!(change->flags & EV_ADD)) {
+      errno = ENOENT;
+      return -1;
+    }
+    if (reg_count == reg_len) {
+      int len = (reg_len > 0 ? reg_len * 2 : 16);
+      registration* p = realloc(regs, sizeof(registration) * len);
+      struct pollfd* q = realloc(polled, sizeof(struct pollfd) * len);
+      if (p != NULL)  regs = p;
+      if (q != NULL)  polled = q;
+      if (p == NULL || q == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+      reg_len = len;
+    }
+    r = &regs[reg_count++];
+    memset(r, 0, sizeof(registration));
+    r->ident = change->ident;
+    r->filter = change->filter;
+    r->enabled = true;
+  }
+  if (change->flags & EV_ADD) {
+    r->udata = change->udata;
+  }
+  if (change->flags & EV_ENABLE) {
+    r->enabled = true;
+  }
+  if (change->flags & EV_DISABLE) {
+    r->enabled = false;
+  }
+  if (change->fflags & NOTE_TRIGGER) {
+    r->triggered = true;
+  }
+  return 0;
+}
+
+
+int kevent(int kq, const struct kevent* changelist, int nchanges, struct kevent* eventlist, int nevents,
+           const struct timespec* timeout) {
+  for (int i=0; i<nchanges; i++) {
+    if (apply(&changelist[i]) < 0) {
+      return -1;
+    }
+  }
+  if (nevents == 0) {
+    return 0;
+  }
+
+  int n = 0, npolled = 0;
+  for (int i=0; i<reg_count && n < nevents; i++) {
+    registration* r = &regs[i];
+    if (r->filter == EVFILT_USER && r->triggered && r->enabled) {
+      r->triggered = false;
+      EV_SET(&eventlist[n++], r->ident, EVFILT_USER, 0, 0, 0, r->udata);
+    }
+  }
+  for (int i=0; i<reg_count; i++) {
+    if (regs[i].filter != EVFILT_USER && regs[i].enabled) {
+      polled[npolled].fd = (int) regs[i].ident;
+      polled[npolled].events = (regs[i].filter == EVFILT_READ ? POLLIN : POLLOUT);
+      polled[npolled].revents = 0;
+      npolled++;
+    }
+  }
+
+  int ms = (n > 0 ? 0 : timeout == NULL ? -1 : (int) (timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000));
+  int ready = poll(polled, npolled, ms);
+  if (ready < 0) {
+    return (n > 0 ? n : -1);
+  }
+
+  for (int i=0, j=0; i<reg_count && n < nevents && ready > 0; i++) {
+    registration* r = &regs[i];
+    if (r->filter == EVFILT_USER || !r->enabled) {
+      continue;
+    }
+    struct pollfd* p = &polled[j++];
+    if (p->revents != 0) {
+      EV_SET(&eventlist[n], r->ident, r->filter, (p->revents & POLLHUP ? EV_EOF : 0), 0, 1, r->udata);
+      n++;
+      ready--;
+    }
+  }
+  return n;
+}
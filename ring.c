@@ -0,0 +1,216 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+/*
+ * Event ring: a file shared with the client (say under /dev/shm) that events are written to instead of
+ * the pipe. fsnotifier creates the file, which must not exist yet, and removes it when the ring is closed.
+ * The file starts with ring_header; records follow in a data area of a power-of-two size.
+ * head and tail count bytes ever written and consumed; fsnotifier only moves head, the client only tail.
+ *
+ * A record is ring_record followed by the path and a zero byte, padded to a multiple of 8. A record never
+ * wraps: where one does not fit before the end of the area, a RING_PAD record fills the rest; it may be as
+ * short as 8 bytes, so only its length and type are there. With RING_ATTRS set in the type, ring_attrs
+ * follows the zero byte at the next multiple of 8 (see ATTRIBUTES in main.c).
+ *
+ * The client reads records until tail reaches head, sets waiting, checks head once more, and then blocks
+ * reading the pipe; the next record clears waiting and sends a WAKE line. When the ring is full, events
+ * are coalesced into RECDIRTY and RESET records until the client makes room.
+ */
+#define RING_MAGIC "FSNE"
+#define RING_VERSION 2
+#define RING_CAPACITY (4 * 1024 * 1024)
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t header_size;  // offset of the data area
+  uint32_t capacity;     // of the data area
+  char pad1[48];
+  atomic_uint_least64_t head;
+  char pad2[56];
+  atomic_uint_least64_t tail;
+  char pad3[56];
+  atomic_uint waiting;
+  char pad4[60];
+} ring_header;
+
+typedef struct {
+  uint32_t length;       // of the whole record
+  uint16_t type;         // RING_* below
+  uint16_t path_length;  // without the zero byte
+  uint64_t seq;          // number of the event record, as in the reply to SYNC
+} ring_record;
+
+// record types; the order is part of the format
+static const char* const ring_types[] = {
+  "", "CHANGE", "STATS", "CREATE", "DELETE", "RECDIRTY", "RESET", "DEGRADED", "BULK", "BULKEND"
+};
+#define RING_PAD 0
+#define RING_ATTRS 0x8000
+
+typedef struct {
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t mode;
+} ring_attrs;
+
+struct __event_ring {
+  char* path;
+  ring_header* header;
+  char* data;
+  size_t size;  // of the mapping
+  uint32_t mask;
+};
+
+
+event_ring* ring_create(const char* path) {
+  event_ring* r = calloc(1, sizeof(event_ring));
+  if (r == NULL || (r->path = strdup(path)) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    free(r);
+    return NULL;
+  }
+  r->size = sizeof(ring_header) + RING_CAPACITY;
+
+  // a file of its own: the name is unlinked along with the ring, and what was there must not be clobbered
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd < 0 || ftruncate(fd, r->size) != 0 ||
+      (r->header = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    userlog(LOG_WARNING, "event ring %s: %s", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    free(r->path);
+    free(r);
+    return NULL;
+  }
+  close(fd);
+
+  ring_header* h = r->header;
+  memcpy(h->magic, RING_MAGIC, 4);
+  h->version = RING_VERSION;
+  h->header_size = sizeof(ring_header);
+  h->capacity = RING_CAPACITY;
+  atomic_init(&h->head, 0);
+  atomic_init(&h->tail, 0);
+  atomic_init(&h->waiting, 0);
+  r->data = (char*) h + sizeof(ring_header);
+  r->mask = RING_CAPACITY - 1;
+  userlog(LOG_INFO, "event ring: %s", path);
+  return r;
+}
+
+
+static uint16_t type_code(const char* type) {
+  for (size_t i = 1; i < sizeof(ring_types) / sizeof(ring_types[0]); i++) {
+    if (strcmp(ring_types[i], type) == 0) {
+      return i;
+    }
+  }
+  return RING_PAD;
+}
+
+// whether the ring has a record type for events of this type
+bool ring_accepts(const char* type) {
+  return type_code(type) != RING_PAD;
+}
+
+
+// false when the ring is full
+bool ring_put(event_ring* r, const char* type, const char* path, uint64_t seq, const struct stat* st) {
+  uint16_t code = type_code(type);
+  size_t path_length = strlen(path);
+  uint32_t attrs_offset = (sizeof(ring_record) + path_length + 1 + 7) & ~7u;
+  uint32_t length = attrs_offset + (st != NULL ? sizeof(ring_attrs) : 0);
+
+  ring_header* h = r->header;
+  uint64_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&h->tail, memory_order_acquire);
+  uint32_t offset = head & r->mask, room = RING_CAPACITY - offset;
+  uint32_t needed = length + (room < length ? room : 0);
+  if (code == RING_PAD || path_length > UINT16_MAX || RING_CAPACITY - (head - tail) < needed) {
+    return false;
+  }
+
+  if (room < length) {
+    ring_record* pad = (ring_record*) (r->data + offset);
+    pad->length = room;
+    pad->type = RING_PAD;
+    pad->path_length = 0;
+    head += room;
+    offset = 0;
+  }
+  ring_record* record = (ring_record*) (r->data + offset);
+  record->length = length;
+  record->type = code | (st != NULL ? RING_ATTRS : 0);
+  record->path_length = path_length;
+  record->seq = seq;
+  memcpy(record + 1, path, path_length + 1);
+  if (st != NULL) {
+    ring_attrs* attrs = (ring_attrs*) ((char*) record + attrs_offset);
+    attrs->ino = st->st_ino;
+    attrs->size = st->st_size;
+    attrs->mtime_sec = st->st_mtim.tv_sec;
+    attrs->mtime_nsec = st->st_mtim.tv_nsec;
+    attrs->mode = st->st_mode;
+  }
+  // sequentially consistent, as the check of waiting that follows must not move before it
+  atomic_store(&h->head, head + length);
+  return true;
+}
+
+
+// whether the client sleeps and has to be woken up through the pipe; the caller does it
+bool ring_take_waiter(event_ring* r) {
+  return atomic_exchange(&r->header->waiting, 0) != 0;
+}
+
+
+size_t ring_used(event_ring* r) {
+  return atomic_load(&r->header->head) - atomic_load(&r->header->tail);
+}
+
+
+size_t ring_capacity(event_ring* r) {
+  return RING_CAPACITY;
+}
+
+
+// the client keeps its mapping; the name goes away with the ring
+void ring_delete(event_ring* r) {
+  if (r != NULL) {
+    munmap(r->header, r->size);
+    unlink(r->path);
+    free(r->path);
+    free(r);
+  }
+}
@@ -0,0 +1,676 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+/*
+ * Shards: roots are spread over worker processes, each with its own kqueue, watch tree and loop, so a storm
+ * under one root neither delays the others nor is limited to one core. The front process talks to the
+ * client: it hands every shard its part of ROOTS, routes queries to the shard owning the path, and is the
+ * only writer of standard output. Shard output is passed on one whole message at a time, in the order of
+ * arrival; replies to ROOTS and STATUS are merged into one, and client commands wait while a merge is open.
+ * Shards tag their replies to ROOTS, so that a root whose crawl fails meanwhile is not taken for one.
+ * Like a session, the front never blocks on the client: commands are read as they arrive and handled once
+ * buffered whole, and output goes through a queue. While the queue is congested, neither the client nor the
+ * shards are read; the shards hold back their events in turn, as RECDIRTY and RESET.
+ */
+#define SHARD_BUF_LEN 65536
+
+typedef struct {
+  pid_t pid;
+  FILE* in;    // commands to the shard
+  int out;     // its output
+  char* buf;
+  size_t len;
+  size_t capacity;
+  bool expected;  // to reply to the open merge
+  bool replied;
+  bool attributed;  // has answered ATTRIBUTES; its CHANGE, STATS and CREATE carry a line of attributes since
+} shard;
+
+typedef struct {
+  char* path;
+  int shard;
+} shard_root;
+
+static shard* shards = NULL;
+static int shard_count = 0;
+static array* roots = NULL;  // shard_root, as last sent
+
+static char* merging = NULL;  // the reply type while replies are collected
+static int awaited = 0;
+static array* merged = NULL;  // lines of the merged reply
+static array* held = NULL;    // messages of shards that have replied already, in arrival order
+static out_queue* out = NULL;  // standard output; see update_sources()
+static char* input = NULL;  // commands read but not handled yet; see handle_input()
+static size_t input_len = 0, input_capacity = 0;
+static size_t input_pos = 0;  // of the next line of the command being handled
+static int in_flags = -1;     // of standard input as found, restored at exit
+static bool input_eof = false;
+static bool input_paused = false;
+static bool shards_paused = false;
+static unsigned long forwarded = 0;  // event records written out; the front numbers them for SYNC and SEQUENCE
+static bool numbered = false;
+
+static bool front_input(void* data);
+static bool handle_input();
+static bool shard_output(void* data);
+
+
+// stable, so that a root stays with its shard across ROOTS commands and is not re-crawled
+static int owner_of(const char* path) {
+  uint32_t h = 2166136261u;
+  for (const char* p = path; *p != '\0'; p++) {
+    h = (h ^ (unsigned char) *p) * 16777619u;
+  }
+  return h % shard_count;
+}
+
+
+int start_shards(int count) {
+  shards = calloc(count, sizeof(shard));
+  if (shards == NULL) {
+    return SHARD_NONE;
+  }
+
+  for (int i=0; i<count; i++) {
+    int in[2], out[2];
+    if (pipe(in) != 0) {
+      break;
+    }
+    if (pipe(out) != 0) {
+      close(in[0]);
+      close(in[1]);
+      break;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      for (int j=0; j<i; j++) {
+        fclose(shards[j].in);
+        close(shards[j].out);
+      }
+      free(shards);
+      shards = NULL;
+      close(in[1]);
+      close(out[0]);
+      if (dup2(in[0], STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0) {
+        _exit(1);
+      }
+      close(in[0]);
+      close(out[1]);
+      return i;
+    }
+
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0 || (shards[i].in = fdopen(in[1], "w")) == NULL) {
+      close(in[1]);
+      close(out[0]);
+      break;
+    }
+    shards[i].pid = pid;
+    shards[i].out = out[0];
+    shard_count++;
+  }
+
+  if (shard_count < count) {
+    close_shards();
+    return SHARD_NONE;
+  }
+  return SHARD_FRONT;
+}
+
+
+static void send_to(int i, const char* command, array* args) {
+  FILE* in = shards[i].in;
+  fprintf(in, "%s\n", command);
+  for (int j=0; j<array_size(args); j++) {
+    fprintf(in, "%s\n", (char*) array_get(args, j));
+  }
+  fflush(in);
+}
+
+static void send_all(const char* command, array* args) {
+  for (int i=0; i<shard_count; i++) {
+    send_to(i, command, args);
+  }
+}
+
+
+static void write_out(const char* text, size_t len) {
+  queue_printf(out, "%.*s", (int) len, text);
+}
+
+
+// event messages; a shard numbers them on its own, so the front numbers them again in the order written out
+static bool is_event(const char* message) {
+  static const char* const types[] = {
+    "CHANGE", "STATS", "CREATE", "DELETE", "RECDIRTY", "RESET", "DEGRADED", "BULK", "BULKEND"
+  };
+  size_t len = strchr(message, '\n') - message;
+  for (size_t i=0; i<sizeof(types) / sizeof(types[0]); i++) {
+    if (strlen(types[i]) == len && strncmp(message, types[i], len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void forward(const char* message) {
+  if (!is_event(message)) {
+    write_out(message, strlen(message));
+    return;
+  }
+  forwarded++;
+  if (numbered) {
+    const char* nl = strchr(message, '\n');
+    queue_printf(out, "%.*s %lu", (int) (nl - message), message, forwarded);
+    message = nl;
+  }
+  write_out(message, strlen(message));
+}
+
+
+// the client is not read while a merge is open; neither it nor the shards while output is congested
+static void update_sources() {
+  bool congested = queue_congested(out);
+  bool pause = (merging != NULL || congested || input_eof);
+  if (pause && !input_paused) {
+    loop_remove_source(STDIN_FILENO);
+  } else if (!pause && input_paused) {
+    loop_add_source(STDIN_FILENO, &front_input, NULL);
+  }
+  input_paused = pause;
+
+  if (congested != shards_paused) {
+    for (int i=0; i<shard_count; i++) {
+      if (congested) {
+        loop_remove_source(shards[i].out);
+      } else {
+        loop_add_source(shards[i].out, &shard_output, &shards[i]);
+      }
+    }
+    shards_paused = congested;
+  }
+}
+
+static void front_drained(void* data) {
+  update_sources();
+}
+
+// waits for the shards flagged as expected
+static void open_merge(const char* type) {
+  merging = strdup(type);
+  awaited = 0;
+  merged = array_create(20);
+  held = array_create(20);
+  for (int i=0; i<shard_count; i++) {
+    shards[i].replied = false;
+    awaited += shards[i].expected;
+  }
+}
+
+// adds up counters line by line; root lines and unwatchable paths are collected once each
+static void merge_reply(const char* text) {
+  const char* end;
+  for (const char* line = strchr(text, '\n') + 1; *line != '\0' && strcmp(line, "#\n") != 0; line = end + 1) {
+    end = strchr(line, '\n');
+    int len = end - line;
+    bool done = false;
+
+    const char* space = memchr(line, ' ', len);
+    if (strcmp(merging, "STATUS") == 0 && space != NULL && strncmp(line, "root ", 5) != 0) {
+      int key = space - line;
+      for (int i=0; i<array_size(merged) && !done; i++) {
+        char* m = array_get(merged, i);
+        if (strncmp(m, line, key + 1) == 0) {
+          char sum[PATH_MAX];
+          snprintf(sum, sizeof(sum), "%.*s%llu", key + 1, line, strtoull(m + key + 1, NULL, 10) + strtoull(space + 1, NULL, 10));
+          array_put(merged, i, strdup(sum));
+          free(m);
+          done = true;
+        }
+      }
+    }
+    else {
+      for (int i=0; i<array_size(merged) && !done; i++) {
+        char* m = array_get(merged, i);
+        done = ((int) strlen(m) == len && strncmp(m, line, len) == 0);
+      }
+    }
+    if (!done) {
+      char* copy = strndup(line, len);
+      if (copy == NULL || array_push(merged, copy) == NULL) {
+        free(copy);
+      }
+    }
+  }
+}
+
+static void close_merge() {
+  const char* type = (strcmp(merging, SHARD_ROOTS_REPLY) == 0 ? "UNWATCHEABLE" : merging);
+  write_out(type, strlen(type));
+  write_out("\n", 1);
+  if (strcmp(merging, "SYNC") == 0) {
+    queue_printf(out, "%lu\n", forwarded);  // every shard has replied, so everything before the barrier is written out
+  }
+  else if (strcmp(merging, "ATTRIBUTES") != 0) {
+    if (strcmp(merging, "STATUS") == 0) {
+      queue_printf(out, "shards %d\n", shard_count);
+    }
+    for (int i=0; i<array_size(merged); i++) {
+      queue_printf(out, "%s\n", (char*) array_get(merged, i));
+    }
+    write_out("#\n", 2);
+  }
+
+  char* message;
+  for (int i=0; (message = array_get(held, i)) != NULL; i++) {
+    forward(message);
+  }
+  array_delete_vs_data(held);
+  array_delete_vs_data(merged);
+  held = merged = NULL;
+  free(merging);
+  merging = NULL;
+  if (!handle_input()) {  // commands that came in meanwhile
+    loop_stop();
+  }
+}
+
+
+// length of the first complete message in buf, 0 if there is none yet
+static size_t message_length(const char* buf, size_t len, bool attributed) {
+  const char* nl = memchr(buf, '\n', len);
+  if (nl == NULL) {
+    return 0;
+  }
+  size_t type_len = nl - buf;
+  int extra = 1;  // lines after the type; -1 up to "#", -2 up to "#" and one more
+  if ((type_len == 12 && strncmp(buf, "UNWATCHEABLE", 12) == 0) || (type_len == 6 && strncmp(buf, "STATUS", 6) == 0) ||
+      (type_len == strlen(SHARD_ROOTS_REPLY) && strncmp(buf, SHARD_ROOTS_REPLY, type_len) == 0) ||
+      (type_len == 4 && strncmp(buf, "LIST", 4) == 0) || (type_len == 8 && strncmp(buf, "ESTIMATE", 8) == 0)) {
+    extra = -1;
+  } else if (type_len == 7 && strncmp(buf, "SUBTREE", 7) == 0) {
+    extra = -2;
+  } else if (type_len == 6 && strncmp(buf, "EXISTS", 6) == 0) {
+    extra = 2;
+  } else if ((type_len == 6 && strncmp(buf, "GIVEUP", 6) == 0) || (type_len == 10 && strncmp(buf, "ATTRIBUTES", 10) == 0)) {
+    extra = 0;
+  } else if (attributed && ((type_len == 6 && (strncmp(buf, "CHANGE", 6) == 0 || strncmp(buf, "CREATE", 6) == 0)) ||
+                            (type_len == 5 && strncmp(buf, "STATS", 5) == 0))) {
+    extra = 2;
+  }
+
+  const char* p = nl + 1;
+  const char* end = buf + len;
+  bool hash_seen = false;
+  while (extra != 0) {
+    const char* eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      return 0;
+    }
+    bool hash = (eol - p == 1 && *p == '#');
+    p = eol + 1;
+    if (extra > 0) {
+      extra--;
+    } else if (hash_seen || (hash && extra == -1)) {
+      extra = 0;
+    } else if (hash) {
+      hash_seen = true;
+    }
+  }
+  return p - buf;
+}
+
+
+static void handle_message(int i, char* message) {
+  bool reply = (merging != NULL && shards[i].expected && !shards[i].replied && strncmp(message, merging, strlen(merging)) == 0 &&
+                message[strlen(merging)] == '\n');
+  if (reply) {
+    merge_reply(message);
+    shards[i].replied = true;
+    shards[i].attributed |= (strcmp(merging, "ATTRIBUTES") == 0);
+    free(message);
+    if (--awaited == 0) {
+      close_merge();
+    }
+  }
+  else if (merging != NULL && shards[i].replied) {
+    if (array_push(held, message) == NULL) {
+      userlog(LOG_ERR, "out of memory");
+      free(message);
+    }
+  }
+  else {
+    forward(message);
+    free(message);
+  }
+}
+
+
+static bool shard_output(void* data) {
+  shard* s = data;
+  int i = s - shards;
+  if (s->capacity - s->len < SHARD_BUF_LEN / 2) {
+    size_t capacity = (s->capacity > 0 ? s->capacity * 2 : SHARD_BUF_LEN);
+    char* buf = realloc(s->buf, capacity);
+    if (buf == NULL) {
+      userlog(LOG_ERR, "out of memory");
+      return false;
+    }
+    s->buf = buf;
+    s->capacity = capacity;
+  }
+
+  ssize_t n = read(s->out, s->buf + s->len, s->capacity - s->len);
+  if (n < 0 && errno == EINTR) {
+    return true;
+  }
+  if (n <= 0) {
+    userlog(LOG_ERR, "shard %d is gone", i);
+    return false;  // the client starts over, as after a crash
+  }
+  s->len += n;
+
+  size_t used = 0, len;
+  while ((len = message_length(s->buf + used, s->len - used, s->attributed)) > 0) {
+    char* message = strndup(s->buf + used, len);
+    if (message == NULL) {
+      userlog(LOG_ERR, "out of memory");
+      return false;
+    }
+    handle_message(i, message);
+    used += len;
+  }
+  memmove(s->buf, s->buf + used, s->len - used);
+  s->len -= used;
+  update_sources();
+  return true;
+}
+
+
+// the next line of the command being handled, trimmed; valid until the command is handled
+static char* next_line() {
+  char* line = input + input_pos;
+  char* nl = memchr(line, '\n', input_len - input_pos);
+  if (nl == NULL) {
+    return NULL;
+  }
+  *nl = '\0';
+  if (nl > line && nl[-1] == '\r')  nl[-1] = '\0';
+  input_pos = nl + 1 - input;
+  return line;
+}
+
+
+static array* read_args(int count) {
+  array* args = array_create(count > 0 ? count : 20);
+  while (args != NULL && (count < 0 || array_size(args) < count)) {
+    char* line = next_line();
+    char* copy = (line != NULL ? strdup(line) : NULL);
+    if (copy == NULL || array_push(args, copy) == NULL) {
+      free(copy);
+      array_delete_vs_data(args);
+      return NULL;
+    }
+    if (count < 0 && (strcmp(line, "#") == 0 || *line == '\0')) {
+      break;  // an empty line ends the list too, see command_length()
+    }
+  }
+  return args;
+}
+
+
+// the shard of the innermost root a path is under; queries outside all roots go to the first one
+static int route(const char* path) {
+  int best = 0;
+  size_t best_len = 0;
+  for (int i=0; i<array_size(roots); i++) {
+    shard_root* r = array_get(roots, i);
+    size_t l = strlen(r->path);
+    if (l > best_len && strncmp(r->path, path, l) == 0 && (path[l] == '\0' || path[l] == '/' || l == 1)) {
+      best = r->shard;
+      best_len = l;
+    }
+  }
+  return best;
+}
+
+
+static void clear_roots() {
+  shard_root* r;
+  while ((r = array_pop(roots)) != NULL) {
+    free(r->path);
+    free(r);
+  }
+}
+
+static bool split_roots(array* args) {
+  array** parts = calloc(shard_count, sizeof(array*));
+  if (parts == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+  clear_roots();
+
+  for (int i=0; i<shard_count; i++) {
+    parts[i] = array_create(20);
+  }
+  for (int i=0; i<array_size(args) - 1; i++) {
+    char* line = array_get(args, i);
+    int mask;
+    const char* path = parse_root(line, &mask);
+    int owner = owner_of(path);
+    shard_root* r = malloc(sizeof(shard_root));
+    if (r != NULL && (r->path = strdup(path)) != NULL && array_push(roots, r) != NULL) {
+      r->shard = owner;
+    } else if (r != NULL) {
+      free(r->path);
+      free(r);
+    }
+    array_push(parts[owner], line);
+  }
+
+  int replies = 0;
+  for (int i=0; i<shard_count; i++) {
+    shards[i].expected = (array_size(parts[i]) > 0);  // an empty ROOTS is not answered
+    replies += shards[i].expected;
+    array_push(parts[i], "#");
+    send_to(i, "ROOTS", parts[i]);
+    array_delete(parts[i]);
+  }
+  free(parts);
+
+  if (replies > 0) {
+    open_merge(SHARD_ROOTS_REPLY);
+  }
+  return true;
+}
+
+
+static bool handle_command() {
+  char* line = next_line();
+  if (line == NULL || strcmp(line, "EXIT") == 0) {
+    return false;
+  }
+  char command[32];
+  strncpy(command, line, sizeof(command) - 1);
+  command[sizeof(command) - 1] = '\0';
+
+  array* args = NULL;
+  bool ok = true;
+  if (strcmp(command, "ROOTS") == 0) {
+    ok = (args = read_args(-1)) != NULL && split_roots(args);
+  }
+  else if (strcmp(command, "HOT") == 0) {
+    ok = (args = read_args(-1)) != NULL;
+    if (ok)  send_all(command, args);
+  }
+  else if (strcmp(command, "STATUS") == 0 || strcmp(command, "SYNC") == 0 || strcmp(command, "ATTRIBUTES") == 0) {
+    send_all(command, NULL);
+    for (int i=0; i<shard_count; i++) {
+      shards[i].expected = true;
+    }
+    open_merge(command);
+  }
+  else if (strcmp(command, "SEQUENCE") == 0) {
+    numbered = true;
+  }
+  else if (strcmp(command, "EXISTS") == 0 || strcmp(command, "LIST") == 0 || strcmp(command, "LIST STAT") == 0 ||
+           strcmp(command, "SUBTREE") == 0 || strcmp(command, "SUBTREE STAT") == 0 || strcmp(command, "ESTIMATE") == 0 ||
+           strcmp(command, "EXPAND") == 0 || strcmp(command, "COLLAPSE") == 0) {
+    ok = (args = read_args(strncmp(command, "SUBTREE", 7) == 0 ? 3 : 1)) != NULL;
+    if (ok) {
+      char buf[PATH_MAX];
+      const char* path = array_get(args, 0);
+      send_to(route(realpath(path, buf) != NULL ? buf : path), command, args);
+    }
+  }
+  else if (strcmp(command, "RING") == 0) {
+    // shard output is merged here, so events stay on the pipe
+    ok = (args = read_args(1)) != NULL;
+    if (ok) {
+      write_out("RING\n0\n", 7);
+    }
+  }
+  else {
+    send_all(command, NULL);
+  }
+  array_delete_vs_data(args);
+  return ok;
+}
+
+// handles the commands buffered whole; they wait while a merge is open
+static bool handle_input() {
+  size_t len;
+  bool ok = true;
+  while (ok && merging == NULL && (len = command_length(input, input_len)) > 0) {
+    input_pos = 0;
+    ok = handle_command();
+    memmove(input, input + len, input_len - len);
+    input_len -= len;
+  }
+  if (ok && input_eof && merging == NULL) {
+    userlog(LOG_DEBUG, "input: <null>");
+    ok = false;
+  }
+  update_sources();
+  return ok;
+}
+
+static bool front_input(void* data) {
+  if (input_capacity - input_len < SHARD_BUF_LEN / 2) {
+    size_t capacity = (input_capacity > 0 ? input_capacity * 2 : SHARD_BUF_LEN);
+    char* buf = (capacity <= INPUT_LIMIT ? realloc(input, capacity) : NULL);
+    if (buf == NULL) {
+      userlog(LOG_WARNING, "input too long or out of memory");
+      return false;
+    }
+    input = buf;
+    input_capacity = capacity;
+  }
+
+  ssize_t n = read(STDIN_FILENO, input + input_len, input_capacity - input_len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  }
+  input_eof = (n <= 0);
+  if (n > 0) {
+    input_len += n;
+  }
+  return handle_input();
+}
+
+
+int run_front() {
+  roots = array_create(20);
+  if (roots == NULL || !init_inotify()) {  // for the kqueue of the loop
+    close_shards();
+    printf("GIVEUP\n");
+    return 1;
+  }
+  userlog(LOG_INFO, "front of %d shards", shard_count);
+  signal(SIGPIPE, SIG_IGN);  // a shard that died is noticed by its output closing
+
+  in_flags = fcntl(STDIN_FILENO, F_GETFL);
+  if (in_flags < 0 || fcntl(STDIN_FILENO, F_SETFL, in_flags | O_NONBLOCK) < 0) {
+    userlog(LOG_WARNING, "fcntl(%d): %s", STDIN_FILENO, strerror(errno));
+  }
+  fflush(stdout);
+  bool ok = (out = queue_create(STDOUT_FILENO, &front_drained, NULL)) != NULL &&
+            loop_add_source(STDIN_FILENO, &front_input, NULL);
+  for (int i=0; i<shard_count && ok; i++) {
+    ok = loop_add_source(shards[i].out, &shard_output, &shards[i]);
+  }
+  if (ok) {
+    loop_run();
+  }
+
+  queue_delete(out, true);  // the client gets the rest of the output
+  out = NULL;
+  if (in_flags >= 0) {
+    fcntl(STDIN_FILENO, F_SETFL, in_flags);
+  }
+  free(input);
+  input = NULL;
+  close_loop();
+  close_inotify();
+  close_shards();
+  return 0;
+}
+
+
+// tells the shards to exit and waits for them
+void close_shards() {
+  for (int i=0; i<shard_count; i++) {
+    fputs("EXIT\n", shards[i].in);
+    fclose(shards[i].in);
+    close(shards[i].out);
+  }
+  for (int i=0; i<shard_count; i++) {
+    waitpid(shards[i].pid, NULL, 0);
+    free(shards[i].buf);
+  }
+  free(shards);
+  shards = NULL;
+  shard_count = 0;
+
+  if (roots != NULL) {
+    clear_roots();
+    array_delete(roots);
+    roots = NULL;
+  }
+  array_delete_vs_data(held);
+  array_delete_vs_data(merged);
+  held = merged = NULL;
+  free(merging);
+  merging = NULL;
+}
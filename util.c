@@ -118,6 +118,59 @@ void array_delete_vs_data(array* a) {
 }
 
 
+// drops NULL elements and gives unused capacity back
+void array_compact(array* a) {
+  if (a == NULL) {
+    return;
+  }
+  int size = 0;
+  for (int i=0; i<a->size; i++) {
+    if (a->data[i] != NULL) {
+      a->data[size++] = a->data[i];
+    }
+  }
+  a->size = size;
+
+  int new_cap = (size > 0 ? size : 1);
+  if (new_cap < a->capacity) {
+    void* new_ptr = realloc(a->data, sizeof(void*) * new_cap);
+    if (new_ptr != NULL) {
+      a->data = new_ptr;
+      a->capacity = new_cap;
+    }
+  }
+}
+
+void array_sort(array* a, int (* compare)(const void*, const void*)) {
+  if (a != NULL && a->size > 1) {
+    qsort(a->data, a->size, sizeof(void*), compare);
+  }
+}
+
+// removes an element by moving the last one into its place; order is not preserved
+void* array_remove(array* a, int index) {
+  void* element = array_get(a, index);
+  if (index >= 0 && index < array_size(a)) {
+    void* last = array_pop(a);
+    if (index < a->size) {
+      a->data[index] = last;
+    }
+  }
+  return element;
+}
+
+
+// like array_remove(), but shifts the tail down so the remaining elements keep their order
+void* array_remove_ordered(array* a, int index) {
+  void* element = array_get(a, index);
+  if (index >= 0 && index < array_size(a)) {
+    memmove(a->data + index, a->data + index + 1, sizeof(void*) * (a->size - index - 1));
+    a->size--;
+  }
+  return element;
+}
+
+
 struct __table {
   void** data;
   int capacity;
@@ -188,3 +241,72 @@ char* read_line(FILE* stream) {
   }
   return input_buf;
 }
+
+
+// lines a command takes after its own; -1 for a list up to "#"
+static int command_args(const char* line, size_t len) {
+  static const struct { const char* command; int args; } commands[] = {
+    { "ROOTS", -1 }, { "HOT", -1 }, { "RING", 1 }, { "ESTIMATE", 1 }, { "EXPAND", 1 }, { "COLLAPSE", 1 },
+    { "EXISTS", 1 }, { "LIST", 1 }, { "LIST STAT", 1 }, { "SUBTREE", 3 }, { "SUBTREE STAT", 3 }
+  };
+  for (size_t i=0; i<sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strlen(commands[i].command) == len && strncmp(line, commands[i].command, len) == 0) {
+      return commands[i].args;
+    }
+  }
+  return 0;
+}
+
+// length of the whole command the input starts with, 0 while it is not buffered whole yet;
+// an empty line ends a list early, as read_paths() sees it
+size_t command_length(const char* input, size_t input_len) {
+  const char* end = input + input_len;
+  int args = 0;
+  bool first = true;
+  for (const char *p = input, *nl; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+    size_t len = nl - p;
+    if (len > 0 && p[len-1] == '\r')  len--;
+    if (first) {
+      args = command_args(p, len);
+      first = false;
+    }
+    else if (args < 0) {
+      args = (len == 0 || (len == 1 && *p == '#') ? 0 : -1);
+    }
+    else {
+      args--;
+    }
+    if (args == 0) {
+      return nl + 1 - input;
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * ROOTS lines are [|][<events>:]<path>, where events are letters naming what is wanted besides creation
+ * and deletion: 'c' for CHANGE and 's' for STATS. A line without them subscribes to everything, so
+ * ":/opt/sdk" watches existence only.
+ */
+const char* parse_root(const char* line, int* mask) {
+  if (line[0] == '|')  line++;  // flat roots will be differentiated later
+
+  *mask = 0;
+  for (const char* p = line; *p != '\0' && *p != '/'; p++) {
+    if (*p == ':') {
+      return p + 1;
+    }
+    else if (*p == 'c') {
+      *mask |= ROOT_CHANGES;
+    }
+    else if (*p == 's') {
+      *mask |= ROOT_STATS;
+    }
+    else {
+      break;
+    }
+  }
+  *mask = ROOT_ALL;
+  return line;
+}
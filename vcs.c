@@ -0,0 +1,423 @@
+/*
+ * Copyright 2000-2010 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+/*
+ * VCS batching: the .git directories of repositories met while crawling are watched on a kqueue of their own,
+ * which the loop polls as an input source. While git holds one of the lock files below, events under the work
+ * tree are held; once the lock is gone (and VCS_SETTLE_MS more, for the last writes to come in) they are sent
+ * as one batch, one record per path and kind, optionally between BULK and BULKEND markers.
+ * A batch is sent after VCS_MAX_MS regardless, so a lock left behind by a crashed git holds nothing for long.
+ * A repository is watched as long as one of the roots it was met in or above is.
+ */
+#define VCS_SETTLE_MS 100
+#define VCS_MAX_MS 30000
+#define VCS_BATCH_LIMIT 65536  // events held per repository; beyond that the batch is a RECDIRTY of the work tree
+
+static const char* const lock_files[] = { "index.lock", "HEAD.lock", "rebase-merge", "rebase-apply" };
+
+// event types that are held, in the order they are sent for one path
+static const char* const batch_types[] = { "DELETE", "CREATE", "CHANGE", "STATS", "RECDIRTY" };
+#define BATCH_DELETE 0x01
+#define BATCH_CREATE 0x02
+
+typedef struct {
+  char* path;
+  unsigned long seq;
+  uint8_t type;   // index into batch_types
+  uint8_t send;   // of the first event of a path: what the batch sends for the path, a bit per batch type
+} held_event;
+
+typedef struct {
+  char* work_tree;
+  int fd;          // of the .git directory
+  bool busy;       // an operation runs, events are held
+  bool settling;   // the lock is gone, the batch goes out when timer fires
+  bool stale;      // sent after VCS_MAX_MS; not held again before the lock goes
+  bool overflow;
+  timer* timer;
+  array* held;
+  array* roots;    // holders of the root trees that use it, NODE_PTR
+} repo;
+
+static int vcs_fd = -1;
+static bool markers = false;
+static array* repos = NULL;
+static unsigned long seq = 0;
+
+static bool vcs_input(void* data);
+
+
+bool init_vcs(bool bulk_markers) {
+  if ((vcs_fd = kqueue()) < 0) {
+    userlog(LOG_ERR, "kqueue: %s", strerror(errno));
+    return false;
+  }
+  if ((repos = array_create(5)) == NULL || !loop_add_source(vcs_fd, &vcs_input, NULL)) {
+    userlog(LOG_ERR, "out of memory");
+    array_delete(repos);
+    repos = NULL;
+    close(vcs_fd);
+    vcs_fd = -1;
+    return false;
+  }
+  markers = bulk_markers;
+  return true;
+}
+
+
+static bool lock_held(repo* r) {
+  for (size_t i = 0; i < sizeof(lock_files) / sizeof(lock_files[0]); i++) {
+    if (faccessat(r->fd, lock_files[i], F_OK, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static int compare_path(const void* a, const void* b) {
+  const held_event* x = *(held_event* const*) a;
+  const held_event* y = *(held_event* const*) b;
+  int c = strcmp(x->path, y->path);
+  return (c != 0 ? c : (x->seq > y->seq) - (x->seq < y->seq));
+}
+
+static int compare_seq(const void* a, const void* b) {
+  const held_event* x = *(held_event* const*) a;
+  const held_event* y = *(held_event* const*) b;
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void free_held(repo* r) {
+  held_event* e;
+  while ((e = array_pop(r->held)) != NULL) {
+    free(e->path);
+    free(e);
+  }
+}
+
+/*
+ * Folds the events of each path into its first one: the last of creation and deletion wins (a deletion
+ * followed by a creation sends both, a creation followed by a deletion nothing), changes to a path deleted
+ * at the time are dropped. The first events stay, in the order they came in.
+ */
+static void fold_batch(array* held) {
+  array_sort(held, &compare_path);
+  held_event* lead = NULL;
+  int born = -1;  // whether the path came into being during the batch; -1 before its first creation or deletion
+  for (int i = 0; i < array_size(held); i++) {
+    held_event* e = array_get(held, i);
+    if (lead == NULL || strcmp(e->path, lead->path) != 0) {
+      lead = e;
+      born = -1;
+    }
+
+    uint8_t bit = 1 << e->type;
+    if (bit == BATCH_CREATE) {
+      lead->send = (lead->send & BATCH_DELETE) | BATCH_CREATE;
+      if (born < 0)  born = 1;
+    } else if (bit == BATCH_DELETE) {
+      lead->send = (born == 1 ? 0 : BATCH_DELETE);
+      if (born < 0)  born = 0;
+    } else if ((lead->send & (BATCH_DELETE | BATCH_CREATE)) != BATCH_DELETE) {
+      lead->send |= bit;
+    }
+
+    if (e != lead) {
+      free(e->path);
+      free(e);
+      array_put(held, i, NULL);
+    }
+  }
+  array_compact(held);
+  array_sort(held, &compare_seq);
+}
+
+static void send_batch(repo* r) {
+  loop_cancel_timer(r->timer);
+  r->timer = NULL;
+  r->busy = r->settling = false;
+  userlog(LOG_INFO, "vcs batch of %s: %d events%s", r->work_tree, array_size(r->held), r->overflow ? " (overflow)" : "");
+
+  if (markers) {
+    output_event("BULK", r->work_tree);
+  }
+  if (r->overflow) {
+    output_event("RECDIRTY", r->work_tree);
+  } else {
+    fold_batch(r->held);
+    for (int i = 0; i < array_size(r->held); i++) {
+      held_event* e = array_get(r->held, i);
+      for (size_t t = 0; t < sizeof(batch_types) / sizeof(batch_types[0]); t++) {
+        if (e->send & (1 << t)) {
+          output_event(batch_types[t], e->path);
+        }
+      }
+    }
+  }
+  if (markers) {
+    output_event("BULKEND", r->work_tree);
+  }
+
+  free_held(r);
+  r->overflow = false;
+}
+
+static void batch_settled(void* data) {
+  repo* r = data;
+  r->timer = NULL;
+  send_batch(r);
+}
+
+static void batch_expired(void* data) {
+  repo* r = data;
+  r->timer = NULL;
+  userlog(LOG_WARNING, "vcs lock in %s held for %d ms", r->work_tree, VCS_MAX_MS);
+  r->stale = true;
+  send_batch(r);
+}
+
+static void update(repo* r) {
+  bool locked = lock_held(r);
+  if (locked && !r->busy && !r->stale) {
+    userlog(LOG_DEBUG, "vcs operation in %s", r->work_tree);
+    r->busy = true;
+    r->timer = loop_add_timer(VCS_MAX_MS, &batch_expired, r);
+  }
+  else if (locked && r->settling) {
+    loop_cancel_timer(r->timer);
+    r->settling = false;
+    r->timer = loop_add_timer(VCS_MAX_MS, &batch_expired, r);
+  }
+  else if (!locked && r->busy && !r->settling) {
+    loop_cancel_timer(r->timer);
+    r->settling = true;
+    r->timer = loop_add_timer(VCS_SETTLE_MS, &batch_settled, r);
+  }
+  else if (!locked) {
+    r->stale = false;
+  }
+}
+
+
+static void drop_repo(int i) {
+  repo* r = array_get(repos, i);
+  if (r->busy) {
+    send_batch(r);
+  }
+  loop_cancel_timer(r->timer);
+  free_held(r);
+  array_remove(repos, i);
+  close(r->fd);  // takes the kevent along
+  free(r->work_tree);
+  array_delete(r->held);
+  array_delete(r->roots);
+  free(r);
+}
+
+static bool vcs_input(void* data) {
+  struct kevent events[16];
+  struct timespec zero = { 0, 0 };
+  int count = kevent(vcs_fd, NULL, 0, events, 16, &zero);
+  for (int n = 0; n < count; n++) {
+    for (int i = 0; i < array_size(repos); i++) {
+      repo* r = array_get(repos, i);
+      if (r->fd != (int) events[n].ident) {
+        continue;
+      }
+      if (events[n].fflags & (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE)) {
+        drop_repo(i);
+      } else {
+        update(r);
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+
+static void add_root(repo* r, node_id root) {
+  for (int i = 0; i < array_size(r->roots); i++) {
+    if (PTR_NODE(array_get(r->roots, i)) == root) {
+      return;
+    }
+  }
+  if (array_push(r->roots, NODE_PTR(root)) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+  }
+}
+
+// starts watching the repository of work_tree for the root, if there is one; root is the holder of its tree
+void vcs_watch(const char* work_tree, node_id root) {
+  if (repos == NULL) {
+    return;
+  }
+  for (int i = 0; i < array_size(repos); i++) {
+    repo* r = array_get(repos, i);
+    if (strcmp(r->work_tree, work_tree) == 0) {
+      add_root(r, root);
+      return;
+    }
+  }
+
+  char git_dir[PATH_MAX];
+  struct stat st;
+  snprintf(git_dir, sizeof(git_dir), "%s/.git", strcmp(work_tree, "/") == 0 ? "" : work_tree);
+  if (stat(git_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return;  // no repository, or a linked work tree; only the main one is watched
+  }
+
+  repo* r = calloc(1, sizeof(repo));
+  if (r == NULL || (r->work_tree = strdup(work_tree)) == NULL || (r->held = array_create(20)) == NULL ||
+      (r->roots = array_create(5)) == NULL || array_push(r->roots, NODE_PTR(root)) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    if (r != NULL) {
+      free(r->work_tree);
+      array_delete(r->held);
+      array_delete(r->roots);
+    }
+    free(r);
+    return;
+  }
+  struct kevent change;
+  if ((r->fd = open(git_dir, O_RDONLY | O_DIRECTORY)) < 0) {
+    userlog(LOG_WARNING, "open(%s): %s", git_dir, strerror(errno));
+  } else {
+    EV_SET(&change, r->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE, 0, 0);
+    if (kevent(vcs_fd, &change, 1, NULL, 0, NULL) == 0 && array_push(repos, r) != NULL) {
+      userlog(LOG_INFO, "vcs: %s", work_tree);
+      r->stale = lock_held(r);  // whatever holds the lock now started before we looked
+      return;
+    }
+    userlog(LOG_WARNING, "kevent(%s): %s", git_dir, strerror(errno));
+    close(r->fd);
+  }
+  free(r->work_tree);
+  array_delete(r->held);
+  array_delete(r->roots);
+  free(r);
+}
+
+// lets the root go; repositories no other root uses are no longer watched
+void vcs_unwatch(node_id root) {
+  for (int i = (repos != NULL ? array_size(repos) - 1 : -1); i >= 0; i--) {
+    repo* r = array_get(repos, i);
+    for (int j = 0; j < array_size(r->roots); j++) {
+      if (PTR_NODE(array_get(r->roots, j)) == root) {
+        array_remove(r->roots, j);
+        break;
+      }
+    }
+    if (array_size(r->roots) == 0) {
+      drop_repo(i);
+    }
+  }
+}
+
+
+// holds an event back if the innermost repository containing path is being updated
+bool vcs_hold(const char* type, const char* path) {
+  if (repos == NULL || array_size(repos) == 0) {
+    return false;
+  }
+  int code = -1;
+  for (size_t t = 0; t < sizeof(batch_types) / sizeof(batch_types[0]) && code < 0; t++) {
+    if (strcmp(batch_types[t], type) == 0)  code = t;
+  }
+  if (code < 0) {
+    return false;
+  }
+
+  repo* owner = NULL;
+  size_t owner_len = 0;
+  for (int i = 0; i < array_size(repos); i++) {
+    repo* r = array_get(repos, i);
+    size_t l = strlen(r->work_tree);
+    if (l > owner_len && strncmp(r->work_tree, path, l) == 0 && (path[l] == '\0' || path[l] == '/' || l == 1)) {
+      owner = r;
+      owner_len = l;
+    }
+  }
+  if (owner == NULL || !owner->busy) {
+    return false;
+  }
+  if (owner->overflow) {
+    return true;
+  }
+  if (array_size(owner->held) >= VCS_BATCH_LIMIT) {
+    userlog(LOG_INFO, "vcs batch of %s overflows", owner->work_tree);
+    free_held(owner);
+    owner->overflow = true;
+    return true;
+  }
+
+  held_event* e = calloc(1, sizeof(held_event));
+  if (e == NULL || (e->path = strdup(path)) == NULL || array_push(owner->held, e) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    if (e != NULL)  free(e->path);
+    free(e);
+    free_held(owner);
+    owner->overflow = true;
+    return true;
+  }
+  e->seq = ++seq;
+  e->type = code;
+  return true;
+}
+
+
+size_t get_vcs_held() {
+  size_t held = 0;
+  for (int i = 0; i < (repos != NULL ? array_size(repos) : 0); i++) {
+    held += array_size(((repo*) array_get(repos, i))->held);
+  }
+  return held;
+}
+
+
+void close_vcs() {
+  if (repos != NULL) {
+    while (array_size(repos) > 0) {
+      repo* r = array_get(repos, 0);
+      r->busy = false;  // nobody to send the batch to anymore
+      drop_repo(0);
+    }
+    array_delete(repos);
+    repos = NULL;
+  }
+  if (vcs_fd >= 0) {
+    loop_remove_source(vcs_fd);
+    close(vcs_fd);
+    vcs_fd = -1;
+  }
+}